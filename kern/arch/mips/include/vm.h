@@ -109,12 +109,15 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct semaphore;
+
 struct tlbshootdown {
 	/*
 	 * Change this to what you need for your VM design.
 	 */
 	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	struct semaphore *ts_done;	/* V'd once the entry is gone */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -36,6 +36,7 @@
 #include <current.h>
 #include <syscall.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 /*
  * System call dispatcher.
@@ -147,6 +148,11 @@ syscall(struct trapframe *tf)
                   break;
           }
 #endif // OPT_A2
+#if OPT_A3
+	case SYS_sbrk:
+	  err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+	  break;
+#endif // OPT_A3
 #endif // UW
  
 	default:
@@ -213,6 +213,27 @@ wait(void)
 	      );
 }
 
+/*
+ * Read the cycle counter.
+ */
+uint32_t
+cpu_cycles(void)
+{
+	uint32_t count;
+
+	/*
+	 * $9 == c0_count; we can't use the symbolic name inside the
+	 * asm string.
+	 */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
 /*
  * Idle the processor until something happens.
  */
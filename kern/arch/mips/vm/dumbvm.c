@@ -34,12 +34,22 @@
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <cpu.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <copyinout.h>
 #include "opt-A2.h"
 #include "opt-A3.h"
+#include "opt-vmdebug.h"
+#if OPT_A3
+#include <uio.h>
+#include <vnode.h>
+#include <synch.h>
+#include <wchan.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+#endif
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
  * enough to struggle off the ground.
@@ -47,6 +57,10 @@
 
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
+#if OPT_A3
+/* the stack starts out that big and grows on faults up to this */
+#define DUMBVM_STACKMAX      (8 * 1024 * 1024)
+#endif
 
 /*
  * Wrap rma_stealmem in a spinlock.
@@ -54,10 +68,295 @@
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
 #if OPT_A3
-static int *coremap;
+/*
+ * Physical pages are handed out by a binary buddy allocator over the
+ * coremap. A block of order k is 2^k pages starting at a coremap index
+ * that is a multiple of 2^k, and its buddy is the block at index ^ 2^k.
+ * Free blocks are kept on one doubly linked list per order, threaded
+ * through the coremap by index, so allocating or freeing touches at
+ * most BUDDY_MAXORDER entries instead of scanning all of RAM.
+ *
+ * Only the first page of a block carries meaningful state. refCount
+ * counts the page table entries sharing an allocated block after a
+ * copy-on-write fork; the block is only released when it drops to 0.
+ *
+ * A user page mapped by exactly one page table entry also records
+ * which one (owner and vaddr), which is what lets it be paged out.
+ * owner is NULL for kernel pages, shared pages, pages still being
+ * filled in and pages on their way out; none of those are evicted.
+ *
+ * Everything here is protected by coremap_lock.
+ */
+#define BUDDY_MAXORDER  10	/* largest block: 1024 pages (4M) */
+#define CM_NONE         (-1)	/* end of a free list */
+
+struct coremap_entry {
+	unsigned refCount;	/* allocated block: number of users */
+	int next, prev;		/* free block: free list links */
+	unsigned char order;	/* log2 of the block size in pages */
+	bool isFree;		/* head of a block on a free list */
+	struct addrspace *owner; /* user page: the address space mapping it */
+	vaddr_t vaddr;		/* ...and where */
+	bool isReferenced;	/* used since the clock hand last passed */
+	unsigned loadStamp;	/* when it became evictable, for FIFO */
+};
+
+static struct coremap_entry *coremap;
 static int numberOfPages;
 static bool isCoremapReady = false;
-static vaddr_t start;
+static paddr_t start;		/* physical address of the first managed page */
+static int freeList[BUDDY_MAXORDER + 1];
+static unsigned freeCount[BUDDY_MAXORDER + 1];
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+/* put the free block at I on the free list for ORDER */
+static
+	void
+buddy_push(int i, unsigned order)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	coremap[i].order = order;
+	coremap[i].isFree = true;
+	coremap[i].prev = CM_NONE;
+	coremap[i].next = freeList[order];
+	if (freeList[order] != CM_NONE){
+		coremap[freeList[order]].prev = i;
+	}
+	freeList[order] = i;
+	freeCount[order]++;
+}
+
+/* take the free block at I off its free list */
+static
+	void
+buddy_unlink(int i)
+{
+	unsigned order = coremap[i].order;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(coremap[i].isFree);
+	if (coremap[i].prev != CM_NONE){
+		coremap[coremap[i].prev].next = coremap[i].next;
+	}else{
+		freeList[order] = coremap[i].next;
+	}
+	if (coremap[i].next != CM_NONE){
+		coremap[coremap[i].next].prev = coremap[i].prev;
+	}
+	coremap[i].isFree = false;
+	freeCount[order]--;
+}
+
+/* smallest order whose blocks hold NPAGES pages */
+static
+	unsigned
+buddy_order(unsigned long npages)
+{
+	unsigned order = 0;
+
+	while ((1UL << order) < npages){
+		order++;
+	}
+	return order;
+}
+
+/*
+ * Allocate a block of the given order, splitting a larger one if
+ * needed. Returns its coremap index, or CM_NONE if nothing is free.
+ */
+static
+	int
+buddy_alloc(unsigned order)
+{
+	unsigned k;
+	int i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	for (k = order; k <= BUDDY_MAXORDER && freeList[k] == CM_NONE; k++);
+	if (k > BUDDY_MAXORDER){
+		return CM_NONE;
+	}
+	i = freeList[k];
+	buddy_unlink(i);
+	// hand the upper halves back until the block is the right size
+	while (k > order){
+		k--;
+		buddy_push(i + (1 << k), k);
+	}
+	coremap[i].order = order;
+	coremap[i].refCount = 1;
+	coremap[i].owner = NULL;
+	return i;
+}
+
+/* free the block at I, merging it with its buddy as far as possible */
+static
+	void
+buddy_free(int i)
+{
+	unsigned order = coremap[i].order;
+	int buddy;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	while (order < BUDDY_MAXORDER){
+		buddy = i ^ (1 << order);
+		if (buddy + (1 << order) > numberOfPages ||
+				!coremap[buddy].isFree ||
+				coremap[buddy].order != order){
+			break;
+		}
+		buddy_unlink(buddy);
+		i &= buddy;
+		order++;
+	}
+	buddy_push(i, order);
+}
+
+/*
+ * Single pages go through a small per-cpu cache in front of the buddy
+ * allocator, so the common one-page alloc and free (kernel stacks,
+ * page tables, kmalloc subpages, user pages) normally takes only the
+ * uncontended per-cpu lock. The cache is refilled from and drained to
+ * the buddy lists PAGECACHE_BATCH pages at a time.
+ *
+ * Cached pages are allocated as far as the buddy allocator is
+ * concerned, with a refCount of 0. Lock order: a cpu's
+ * c_pagecache_lock before coremap_lock.
+ */
+#define PAGECACHE_BATCH  (CPU_PAGECACHE_MAX / 2)
+
+#define CM_INDEX(paddr)  ((int)(((paddr) - start) / PAGE_SIZE))
+#define CM_PADDR(i)      (start + (paddr_t)(i) * PAGE_SIZE)
+
+/* take a single page from this cpu's cache, refilling it if empty */
+static
+	int
+pagecache_get(void)
+{
+	struct cpu *c = curcpu->c_self;
+	int i = CM_NONE;
+
+	spinlock_acquire(&c->c_pagecache_lock);
+	if (c->c_pagecache_count == 0){
+		c->c_pagecache_misses++;
+		spinlock_acquire(&coremap_lock);
+		while (c->c_pagecache_count < PAGECACHE_BATCH){
+			int j = buddy_alloc(0);
+			if (j == CM_NONE){
+				break;
+			}
+			coremap[j].refCount = 0;
+			c->c_pagecache[c->c_pagecache_count++] = CM_PADDR(j);
+		}
+		spinlock_release(&coremap_lock);
+	}else{
+		c->c_pagecache_hits++;
+	}
+	if (c->c_pagecache_count > 0){
+		i = CM_INDEX(c->c_pagecache[--c->c_pagecache_count]);
+		coremap[i].refCount = 1;
+	}
+	spinlock_release(&c->c_pagecache_lock);
+	return i;
+}
+
+/* give the single page at I to this cpu's cache, draining it if full */
+static
+	void
+pagecache_put(int i)
+{
+	struct cpu *c = curcpu->c_self;
+
+	KASSERT(coremap[i].order == 0 && coremap[i].refCount == 0);
+	spinlock_acquire(&c->c_pagecache_lock);
+	if (c->c_pagecache_count == CPU_PAGECACHE_MAX){
+		spinlock_acquire(&coremap_lock);
+		while (c->c_pagecache_count > CPU_PAGECACHE_MAX - PAGECACHE_BATCH){
+			buddy_free(CM_INDEX(c->c_pagecache[--c->c_pagecache_count]));
+		}
+		spinlock_release(&coremap_lock);
+	}
+	c->c_pagecache[c->c_pagecache_count++] = CM_PADDR(i);
+	spinlock_release(&c->c_pagecache_lock);
+}
+
+/*
+ * Return every cpu's cached pages to the buddy allocator. Used when
+ * an allocation fails, since the pages it needs may be sitting idle
+ * in some cache.
+ */
+static
+	void
+pagecache_drainall(void)
+{
+	struct cpu *c;
+
+	for (unsigned n = 0; n < cpu_count(); n++){
+		c = cpu_get(n);
+		spinlock_acquire(&c->c_pagecache_lock);
+		spinlock_acquire(&coremap_lock);
+		while (c->c_pagecache_count > 0){
+			buddy_free(CM_INDEX(c->c_pagecache[--c->c_pagecache_count]));
+		}
+		spinlock_release(&coremap_lock);
+		spinlock_release(&c->c_pagecache_lock);
+	}
+}
+
+/*
+ * Paging: when memory runs out, user pages are written to swap (or
+ * dropped, if they can be read back from the executable) and their
+ * frames reused. Each address space's as_lock protects the
+ * residency state of its page table entries (frame, isValid,
+ * isSwapped, isBusy) against the page-out code; lock order is
+ * coremap_lock before as_lock. A pte marked busy is being written out,
+ * and anyone who needs it sleeps on vm_pagewaitchan until it's done.
+ */
+static struct wchan *vm_pagewaitchan;
+static struct lock *vm_shootdown_lock;	/* one page-out shootdown at a time */
+static struct semaphore *vm_shootdown_sem;
+static int evictHand;			/* clock hand: next index to consider */
+
+#define VM_POLICY_FIFO    0	/* oldest page first */
+#define VM_POLICY_RANDOM  1	/* any page */
+#define VM_POLICY_CLOCK   2	/* second chance via reference bits */
+#define VM_NPOLICIES      3
+
+static const struct {
+	const char *name;
+	unsigned stat;		/* evictions counter */
+} vm_policies[VM_NPOLICIES] = {
+	{ "fifo",   VMSTAT_EVICT_FIFO },
+	{ "random", VMSTAT_EVICT_RANDOM },
+	{ "clock",  VMSTAT_EVICT_CLOCK },
+};
+
+static unsigned vm_policy = VM_POLICY_CLOCK;
+static unsigned loadClock;		/* source of loadStamp values */
+
+static int vm_evict(void);
+
+/* can the current thread block for page-out I/O? */
+static
+	bool
+vm_maysleep(void)
+{
+	return vm_shootdown_lock != NULL && curthread != NULL &&
+		!curthread->t_in_interrupt && curthread->t_iplhigh_count == 0;
+}
+
+/*
+ * TLB address space IDs. Address spaces get an ASID from asid_next,
+ * tagged with the current generation; when they run out, the
+ * generation moves on and every address space needs a new one. A cpu
+ * flushes its TLB only when it first activates an ASID from a newer
+ * generation than the one its TLB holds, so otherwise switching
+ * address spaces leaves everyone's entries alone. ASID 0 is never
+ * handed out.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static unsigned asid_gen = 1;
+static unsigned asid_next = 1;
 #endif
 
 	void
@@ -71,18 +370,50 @@ vm_bootstrap(void)
 	int n = (hi - lo) / PAGE_SIZE; // get number of free pages
 	hi = lo + n * PAGE_SIZE;
 	KASSERT((hi % PAGE_SIZE) == 0);
-	int coremapSize = n * sizeof(int);
+	int coremapSize = n * sizeof(struct coremap_entry);
 	coremapSize = ROUNDUP(coremapSize, PAGE_SIZE);
-	start = lo;
-	coremap = (int *)(PADDR_TO_KVADDR(start));
+	coremap = (struct coremap_entry *)(PADDR_TO_KVADDR(lo));
 	lo += coremapSize;
 	KASSERT((lo % PAGE_SIZE) == 0);
+	// managed pages start after the coremap itself
+	start = lo;
 	numberOfPages = (hi - lo) / PAGE_SIZE;
-	// set each page in coremap as available
+
+	spinlock_acquire(&coremap_lock);
 	for (int i = 0; i < numberOfPages; i++){
-		coremap[i] = 0;
+		coremap[i].refCount = 0;
+		coremap[i].next = coremap[i].prev = CM_NONE;
+		coremap[i].order = 0;
+		coremap[i].isFree = false;
+		coremap[i].owner = NULL;
+	}
+	for (int k = 0; k <= BUDDY_MAXORDER; k++){
+		freeList[k] = CM_NONE;
+		freeCount[k] = 0;
+	}
+	// carve the pages into the largest aligned blocks that fit
+	for (int i = 0; i < numberOfPages; ){
+		unsigned order = BUDDY_MAXORDER;
+		while ((i & ((1 << order) - 1)) != 0 ||
+				i + (1 << order) > numberOfPages){
+			order--;
+		}
+		buddy_push(i, order);
+		i += 1 << order;
 	}
+	spinlock_release(&coremap_lock);
+
 	isCoremapReady = true;
+	vmstats_init();
+
+	vm_pagewaitchan = wchan_create("vm_pagewait");
+	vm_shootdown_lock = lock_create("vm_shootdown");
+	vm_shootdown_sem = sem_create("vm_shootdown", 0);
+	if (vm_pagewaitchan == NULL || vm_shootdown_lock == NULL ||
+			vm_shootdown_sem == NULL){
+		panic("vm_bootstrap: out of memory\n");
+	}
+	swap_bootstrap();
 #endif
 	/* Do nothing. */
 }
@@ -94,32 +425,31 @@ getppages(unsigned long npages)
 	paddr_t addr;
 #if OPT_A3
 	if (isCoremapReady){
-		addr = 0;
-		int i = 0;
-		while ((int)(i + npages) < numberOfPages){
-			if (coremap[i] == 0){
-				bool complete = true;
-				// check if there's a contiguous block available
-				for (unsigned j = 0; j < npages; j++){
-					if (coremap[i + j] != 0){
-						i += j + 1;
-						complete = false;
-					}
-				}
-				// if available, set block of npages pages to no longer free
-				if (complete){
-					for (unsigned j = 0; j < npages; j++){
-						// each page in block stores how many pages in block are left (including self)
-						coremap[i + j] = npages - j;
-					}
-					// return address of first page in contiguous block
-					addr = start + i * PAGE_SIZE;
-					break;
-				}
-			}else{
-				i++;
+		unsigned order = buddy_order(npages);
+		int i = CM_NONE;
+
+		if (order == 0){
+			i = pagecache_get();
+		}
+		if (i == CM_NONE && order <= BUDDY_MAXORDER){
+			if (order > 0){
+				spinlock_acquire(&coremap_lock);
+				i = buddy_alloc(order);
+				spinlock_release(&coremap_lock);
+			}
+			if (i == CM_NONE){
+				// pull back pages parked in per-cpu caches
+				pagecache_drainall();
+				spinlock_acquire(&coremap_lock);
+				i = buddy_alloc(order);
+				spinlock_release(&coremap_lock);
 			}
 		}
+		if (i == CM_NONE && order == 0 && vm_maysleep()){
+			// last resort: push a user page out to swap and take its frame
+			i = vm_evict();
+		}
+		addr = (i == CM_NONE) ? 0 : CM_PADDR(i);
 	}else{
 #endif
 		spinlock_acquire(&stealmem_lock);
@@ -147,14 +477,29 @@ alloc_kpages(int npages)
 free_kpages(vaddr_t addr)
 {
 #if OPT_A3
-	if (isCoremapReady){
-		int i = (addr - PADDR_TO_KVADDR(start)) / PAGE_SIZE;
+	if (isCoremapReady && addr >= PADDR_TO_KVADDR(start)){
+		int i = CM_INDEX(KVADDR_TO_PADDR(addr));
 		KASSERT(i < numberOfPages);
-		int n = coremap[i]; // first page in block in coremap stores how many pages in block
-		KASSERT((i + n) < numberOfPages);
-		for (int j = 0; j < n; j++){
-			coremap[i + j] = 0;
+		KASSERT(!coremap[i].isFree);
+		KASSERT((i & ((1 << coremap[i].order) - 1)) == 0);
+		KASSERT(coremap[i].refCount > 0);
+		if (coremap[i].order == 0 && coremap[i].refCount == 1){
+			/*
+			 * We hold the only reference, so nobody else can
+			 * be changing it: skip the coremap lock entirely.
+			 */
+			KASSERT(coremap[i].owner == NULL);
+			coremap[i].refCount = 0;
+			pagecache_put(i);
+			return;
+		}
+		spinlock_acquire(&coremap_lock);
+		// shared copy-on-write pages stay around until the last user lets go
+		coremap[i].refCount--;
+		if (coremap[i].refCount == 0){
+			buddy_free(i);
 		}
+		spinlock_release(&coremap_lock);
 	}else{
 #endif
 		/* nothing - leak the memory. */
@@ -164,24 +509,721 @@ free_kpages(vaddr_t addr)
 #endif
 }
 
+	void
+vm_printstats(void)
+{
+#if OPT_A3
+	unsigned counts[BUDDY_MAXORDER + 1];
+	unsigned freePages = 0;
+	unsigned cached, hits, misses;
+	unsigned used, total;
+	struct cpu *c;
+
+	spinlock_acquire(&coremap_lock);
+	for (int k = 0; k <= BUDDY_MAXORDER; k++){
+		counts[k] = freeCount[k];
+		freePages += freeCount[k] << k;
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %u of %d pages free\n", freePages, numberOfPages);
+	for (int k = 0; k <= BUDDY_MAXORDER; k++){
+		kprintf("    order %2d (%4d pages): %u free\n", k, 1 << k, counts[k]);
+	}
+
+	for (unsigned n = 0; n < cpu_count(); n++){
+		c = cpu_get(n);
+		spinlock_acquire(&c->c_pagecache_lock);
+		cached = c->c_pagecache_count;
+		hits = c->c_pagecache_hits;
+		misses = c->c_pagecache_misses;
+		spinlock_release(&c->c_pagecache_lock);
+
+		kprintf("cpu%u page cache: %u cached, %u hits, %u misses",
+			n, cached, hits, misses);
+		if (hits + misses > 0){
+			kprintf(" (%u%% hit rate)", hits * 100 / (hits + misses));
+		}
+		kprintf("\n");
+	}
+
+	if (swap_enabled()){
+		swap_usage(&used, &total);
+		kprintf("swap: %u of %u pages in use\n", used, total);
+	}else{
+		kprintf("swap: disabled\n");
+	}
+	kprintf("page replacement policy: %s\n", vm_policies[vm_policy].name);
+#else
+	kprintf("dumbvm: no page allocator statistics\n");
+#endif
+}
+
+#if OPT_A3
+/*
+ * Record that the user page at PADDR is now mapped at VADDR in AS and
+ * nowhere else, which makes it a candidate for page-out. Pages that
+ * turn out to be shared are left alone.
+ */
+static
+	void
+frame_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	int i = CM_INDEX(paddr);
+
+	KASSERT(paddr >= start && i < numberOfPages);
+	spinlock_acquire(&coremap_lock);
+	KASSERT(!coremap[i].isFree && coremap[i].order == 0);
+	if (coremap[i].refCount == 1 && coremap[i].owner == NULL){
+		coremap[i].owner = as;
+		coremap[i].vaddr = vaddr;
+		coremap[i].isReferenced = true;
+		coremap[i].loadStamp = loadClock++;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Drop AS's reference to the user page at PADDR. If AS was the
+ * recorded owner, whoever still maps the page is unknown from here
+ * on, so it stops being evictable until they touch it again.
+ */
+static
+	void
+frame_release(paddr_t paddr, struct addrspace *as)
+{
+	int i = CM_INDEX(paddr);
+
+	KASSERT(paddr >= start && i < numberOfPages);
+	spinlock_acquire(&coremap_lock);
+	if (coremap[i].owner == as){
+		coremap[i].owner = NULL;
+	}
+	spinlock_release(&coremap_lock);
+	free_kpages(PADDR_TO_KVADDR(paddr));
+}
+
+/* count a TLB invalidation, both in total and for its REASON */
+static
+	void
+vm_tlbstat(unsigned reason)
+{
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+	vmstats_inc(reason);
+}
+
+/*
+ * Drop AS's mapping of VADDR from this cpu's TLB, if it's there. If
+ * this cpu's TLB is from an older ASID generation than AS's ASID, it
+ * can only hold entries under ASIDs AS has given up, which won't be
+ * matched again before the TLB is flushed.
+ */
+static
+	void
+vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned asid;
+	bool mine;
+	int i, spl;
+
+	spl = splhigh();
+	spinlock_acquire(&asid_lock);
+	mine = as->as_asidgen == curcpu->c_asidgen;
+	asid = as->as_asid;
+	spinlock_release(&asid_lock);
+	if (mine){
+		i = tlb_probe(vaddr | (asid << TLBHI_PIDSHIFT), 0);
+		if (i >= 0){
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+		tlb_setpid(curcpu->c_asid);
+	}
+	splx(spl);
+}
+
+/*
+ * Make AS give up its ASID, which in one step kills its entries in
+ * every cpu's TLB; it gets a fresh one the next time it's activated.
+ */
+static
+	void
+vm_retireasid(struct addrspace *as)
+{
+	spinlock_acquire(&asid_lock);
+	as->as_asidgen = 0;
+	spinlock_release(&asid_lock);
+	vm_tlbstat(VMSTAT_TLB_INVALIDATE_RETIRE);
+}
+#endif
+
+	void
+vm_tlbshootdown_all(void)
+{
+#if OPT_A3
+	/*
+	 * Only reached if a cpu's shootdown queue overflows, which
+	 * vm_shootdown_lock prevents; the waiters would never be woken.
+	 */
+	panic("dumbvm: tlb shootdown queue overflowed\n");
+#else
+	panic("dumbvm tried to do tlb shootdown?!\n");
+#endif
+}
+
+	void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+#if OPT_A3
+	vm_tlbinvalidate(ts->ts_addrspace, ts->ts_vaddr);
+	V(ts->ts_done);
+#else
+	(void)ts;
+	panic("dumbvm tried to do tlb shootdown?!\n");
+#endif
+}
+
+static
+	void
+as_zero_region(paddr_t paddr, unsigned npages)
+{
+	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+}
+
+#if OPT_A3
+/* mark every entry of a freshly allocated page table as not present */
+static
+	void
+pt_clear(struct pt_entry *pt, unsigned npages)
+{
+	for (unsigned i = 0; i < npages; i++){
+		pt[i].frame = 0;
+		pt[i].isValid = false;
+		pt[i].isCopyOnWrite = false;
+		pt[i].isSwapped = false;
+		pt[i].isBusy = false;
+		pt[i].swapSlot = 0;
+	}
+}
+
+/*
+ * Work out which region of AS the page at VADDR belongs to; false if
+ * none. Optionally hands back the ELF backing of the region (NULL for
+ * the stack) and whether it is the text segment.
+ */
+static
+	bool
+vm_region(struct addrspace *as, vaddr_t vaddr,
+		const struct elf_backing **eb, bool *isCode)
+{
+	const struct elf_backing *b = NULL;
+	bool found = true, code = false;
+
+	if (vaddr >= as->as_vbase1 &&
+			vaddr < as->as_vbase1 + as->as_npages1 * PAGE_SIZE){
+		b = &as->as_elf1;
+		code = true;
+	}else if (vaddr >= as->as_vbase2 &&
+			vaddr < as->as_vbase2 + as->as_npages2 * PAGE_SIZE){
+		b = &as->as_elf2;
+	}else if (vaddr >= as->as_heapbase && vaddr < as->as_heaptop){
+		// zero-filled like the stack
+	}else if (vaddr < as->as_stackbase || vaddr >= USERSTACK){
+		found = false;
+	}
+
+	if (eb != NULL){
+		*eb = b;
+	}
+	if (isCode != NULL){
+		*isCode = code;
+	}
+	return found;
+}
+
+/*
+ * Grow AS's stack down to the page at VADDR, if that stays within
+ * DUMBVM_STACKMAX and clear of the text and data segments. The heap
+ * never reaches that far up (see as_sbrk). Only the owning process
+ * calls this, from vm_fault.
+ */
+static
+	bool
+vm_growstack(struct addrspace *as, vaddr_t vaddr)
+{
+	if (vaddr >= as->as_stackbase || vaddr < USERSTACK - DUMBVM_STACKMAX){
+		return false;
+	}
+	if (vaddr < as->as_vbase1 + as->as_npages1 * PAGE_SIZE ||
+			vaddr < as->as_vbase2 + as->as_npages2 * PAGE_SIZE){
+		return false;
+	}
+	as->as_stackbase = vaddr;
+	return true;
+}
+
+/*
+ * Find the page table entry for VADDR in AS. If the second-level table
+ * covering it hasn't been needed yet, it is allocated when CREATE is
+ * set and NULL is returned otherwise (or if allocation fails).
+ */
+static
+	struct pt_entry *
+pt_walk(struct addrspace *as, vaddr_t vaddr, bool create)
+{
+	unsigned i1 = vaddr / PAGE_SIZE / PT_L2_SIZE;
+	struct pt_entry *pt;
+
+	KASSERT(i1 < PT_L1_SIZE);
+	pt = as->as_pt[i1];
+	if (pt == NULL){
+		if (!create){
+			return NULL;
+		}
+		pt = kmalloc(PT_L2_SIZE * sizeof(struct pt_entry));
+		if (pt == NULL){
+			return NULL;
+		}
+		pt_clear(pt, PT_L2_SIZE);
+		as->as_pt[i1] = pt;
+	}
+	return &pt[vaddr / PAGE_SIZE % PT_L2_SIZE];
+}
+
+/*
+ * Wait for a page-out of one of AS's pages to finish. Called with
+ * as_lock held, which is released; the caller must look at the pte
+ * again afterwards.
+ */
+static
+	void
+vm_pagewait(struct addrspace *as)
+{
+	wchan_lock(vm_pagewaitchan);
+	spinlock_release(&as->as_lock);
+	wchan_sleep(vm_pagewaitchan);
+}
+
+/*
+ * Remove VADDR from every cpu's TLB and wait until they have all done
+ * it, so nobody can still be writing to the page when it goes out to
+ * swap. Shootdowns are serialized, which keeps each cpu's queue at one
+ * entry at most.
+ */
+static
+	void
+vm_shootdown(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+	struct cpu *c;
+	unsigned sent = 0;
+	int spl;
+
+	ts.ts_addrspace = as;
+	ts.ts_vaddr = vaddr;
+	ts.ts_done = vm_shootdown_sem;
+
+	lock_acquire(vm_shootdown_lock);
+	// stay on this cpu while deciding which ones need an interrupt
+	spl = splhigh();
+	vm_tlbinvalidate(as, vaddr);
+	for (unsigned n = 0; n < cpu_count(); n++){
+		c = cpu_get(n);
+		if (c != curcpu->c_self){
+			ipi_tlbshootdown(c, &ts);
+			sent++;
+		}
+	}
+	splx(spl);
+	while (sent > 0){
+		P(vm_shootdown_sem);
+		sent--;
+	}
+	lock_release(vm_shootdown_lock);
+	vm_tlbstat(VMSTAT_TLB_INVALIDATE_PAGEOUT);
+}
+
+/*
+ * Page replacement. MIPS keeps no reference bits, so they are
+ * emulated: vm_fault sets isReferenced whenever it loads a page into
+ * the TLB, and the clock hand clears it and knocks the page out of
+ * this cpu's TLB, so the next use faults and sets it again. Other
+ * cpus aren't interrupted for this, which only makes the bit less
+ * precise for pages they have mapped.
+ *
+ * A victim must be claimed: under its owner's as_lock its pte is
+ * checked and marked busy. Text pages are never written, so they are
+ * just dropped and read back from the executable when next needed;
+ * anything else needs a swap slot.
+ */
+	int
+vm_setpolicy(const char *name)
+{
+	for (unsigned k = 0; k < VM_NPOLICIES; k++){
+		if (!strcmp(name, vm_policies[k].name)){
+			vm_policy = k;
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+/* what to do with a page once it has been claimed */
+struct victim {
+	struct addrspace *as;
+	struct pt_entry *pte;
+	vaddr_t vaddr;
+	bool isClean;		/* can be dropped and re-read from the ELF file */
+};
+
+/*
+ * Try to claim the page in frame J for eviction. Dirty pages are only
+ * taken if HASSLOT says there is somewhere to put them.
+ */
+static
+	bool
+evict_claim(int j, bool hasSlot, struct victim *v)
+{
+	struct addrspace *owner = coremap[j].owner;
+	struct pt_entry *pte;
+	bool isCode, claimed = false;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	if (owner == NULL || coremap[j].refCount != 1){
+		return false;
+	}
+	vm_region(owner, coremap[j].vaddr, NULL, &isCode);
+	pte = pt_walk(owner, coremap[j].vaddr, false);
+	KASSERT(pte != NULL);
+	isCode = isCode && owner->as_vnode != NULL;
+	if (!isCode && !hasSlot){
+		return false;
+	}
+
+	spinlock_acquire(&owner->as_lock);
+	// the owner may be in the middle of unmapping it
+	if (pte->isValid && pte->frame == CM_PADDR(j)){
+		KASSERT(!pte->isBusy);
+		pte->isValid = false;
+		pte->isBusy = true;
+		v->as = owner;
+		v->pte = pte;
+		v->vaddr = coremap[j].vaddr;
+		v->isClean = isCode;
+		coremap[j].owner = NULL;
+		claimed = true;
+	}
+	spinlock_release(&owner->as_lock);
+	return claimed;
+}
+
+/* FIFO: the page that became evictable longest ago */
+static
+	int
+evict_fifo(bool hasSlot, struct victim *v)
+{
+	unsigned floor = 0;
+	bool haveFloor = false;
+	int best;
+
+	// stamps are unique, so moving past ones we fail to claim terminates
+	for (;;){
+		best = CM_NONE;
+		for (int j = 0; j < numberOfPages; j++){
+			if (coremap[j].owner == NULL || coremap[j].refCount != 1){
+				continue;
+			}
+			if (haveFloor && coremap[j].loadStamp <= floor){
+				continue;
+			}
+			if (best == CM_NONE ||
+					coremap[j].loadStamp < coremap[best].loadStamp){
+				best = j;
+			}
+		}
+		if (best == CM_NONE || evict_claim(best, hasSlot, v)){
+			return best;
+		}
+		floor = coremap[best].loadStamp;
+		haveFloor = true;
+	}
+}
+
+/* random: the first claimable page from a random starting point */
+static
+	int
+evict_random(bool hasSlot, struct victim *v, uint32_t rnd)
+{
+	int j;
+
+	for (int n = 0; n < numberOfPages; n++){
+		j = (rnd + n) % numberOfPages;
+		if (evict_claim(j, hasSlot, v)){
+			return j;
+		}
+	}
+	return CM_NONE;
+}
+
+/* clock: sweep the hand, giving recently used pages a second chance */
+static
+	int
+evict_clock(bool hasSlot, struct victim *v)
+{
+	int j;
+
+	// two turns: the first may only clear reference bits
+	for (int n = 0; n < 2 * numberOfPages; n++){
+		j = evictHand;
+		evictHand = (evictHand + 1) % numberOfPages;
+		if (coremap[j].owner == NULL || coremap[j].refCount != 1){
+			continue;
+		}
+		if (coremap[j].isReferenced){
+			coremap[j].isReferenced = false;
+			vm_tlbinvalidate(coremap[j].owner, coremap[j].vaddr);
+			vm_tlbstat(VMSTAT_TLB_INVALIDATE_CLOCK);
+			vmstats_inc(VMSTAT_CLOCK_SECOND_CHANCE);
+			continue;
+		}
+		if (evict_claim(j, hasSlot, v)){
+			return j;
+		}
+	}
+	return CM_NONE;
+}
+
+/*
+ * Free up a frame by evicting a user page, chosen by the current
+ * policy among pages with a known single owner. Returns the coremap
+ * index of the frame, which now belongs to the caller, or CM_NONE if
+ * nothing could be evicted.
+ */
+static
+	int
+vm_evict(void)
+{
+	struct victim v;
+	unsigned policy = vm_policy;
+	unsigned slot = 0;
+	bool hasSlot;
+	uint32_t rnd;
+	int i, result;
+
+	hasSlot = swap_alloc(&slot) == 0;
+	// the random device isn't something to call under a spinlock
+	rnd = policy == VM_POLICY_RANDOM ? random() : 0;
+
+	spinlock_acquire(&coremap_lock);
+	switch (policy){
+		case VM_POLICY_FIFO:
+			i = evict_fifo(hasSlot, &v);
+			break;
+		case VM_POLICY_RANDOM:
+			i = evict_random(hasSlot, &v, rnd);
+			break;
+		default:
+			i = evict_clock(hasSlot, &v);
+			break;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (i == CM_NONE){
+		if (hasSlot){
+			swap_free(slot);
+		}
+		return CM_NONE;
+	}
+	if (v.isClean && hasSlot){
+		swap_free(slot);
+	}
+
+	vm_shootdown(v.as, v.vaddr);
+	result = v.isClean ? 0 : swap_write(slot, CM_PADDR(i));
+
+	spinlock_acquire(&v.as->as_lock);
+	v.pte->isBusy = false;
+	if (result){
+		// leave the page where it was
+		v.pte->isValid = true;
+	}else if (!v.isClean){
+		v.pte->isSwapped = true;
+		v.pte->isCopyOnWrite = false;
+		v.pte->swapSlot = slot;
+		v.pte->frame = 0;
+	}else{
+		// not resident and not swapped: vm_pagein reads it again
+		v.pte->frame = 0;
+	}
+	spinlock_release(&v.as->as_lock);
+	wchan_wakeall(vm_pagewaitchan);
+
+	if (result){
+		kprintf("dumbvm: swap write failed: %s\n", strerror(result));
+		swap_free(slot);
+		frame_setowner(CM_PADDR(i), v.as, v.vaddr);
+		return CM_NONE;
+	}
+	if (v.isClean){
+		vmstats_inc(VMSTAT_CLEAN_DISCARD);
+	}else{
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	}
+	vmstats_inc(vm_policies[policy].stat);
+	return i;
+}
+
+/* make PTE map PADDR, now that the page has been filled in */
+static
+	void
+pt_setframe(struct addrspace *as, struct pt_entry *pte, paddr_t paddr)
+{
+	spinlock_acquire(&as->as_lock);
+	pte->frame = paddr;
+	pte->isValid = true;
+	pte->isSwapped = false;
+	spinlock_release(&as->as_lock);
+}
+
+/*
+ * Bring in the page at VADDR for a process that has never touched it
+ * before: grab a zeroed frame and, if the page overlaps the
+ * file-backed part of the segment described by EB, read that part
+ * from the executable. EB is NULL for pages with no file backing
+ * (the stack).
+ */
+static
+	int
+vm_pagein(struct addrspace *as, const struct elf_backing *eb,
+		struct pt_entry *pte, vaddr_t vaddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t lo, hi;
+	paddr_t paddr;
+	int result;
+
+	paddr = getppages(1);
+	if (paddr == 0){
+		return ENOMEM;
+	}
+	as_zero_region(paddr, 1);
+
+	lo = hi = 0;
+	if (eb != NULL && as->as_vnode != NULL){
+		lo = vaddr > eb->vaddr ? vaddr : eb->vaddr;
+		hi = vaddr + PAGE_SIZE;
+		if (hi > eb->vaddr + eb->filesize){
+			hi = eb->vaddr + eb->filesize;
+		}
+	}
+
+	if (lo < hi){
+		uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + (lo - vaddr)),
+				hi - lo, eb->offset + (lo - eb->vaddr), UIO_READ);
+		result = VOP_READ(as->as_vnode, &ku);
+		if (result == 0 && ku.uio_resid != 0){
+			/* load_segment checked the size, so this shouldn't happen */
+			result = ENOEXEC;
+		}
+		if (result){
+			free_kpages(PADDR_TO_KVADDR(paddr));
+			return result;
+		}
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+	}else{
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+	}
+
+	pt_setframe(as, pte, paddr);
+	return 0;
+}
+
+/*
+ * Read a page back in from swap. Nothing but the owning process looks
+ * at a swapped-out pte, so it can't change under us.
+ */
+static
+	int
+vm_swapin(struct addrspace *as, struct pt_entry *pte)
+{
+	paddr_t paddr;
+	int result;
+
+	KASSERT(pte->isSwapped);
 
-	void
-vm_tlbshootdown_all(void)
-{
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	paddr = getppages(1);
+	if (paddr == 0){
+		return ENOMEM;
+	}
+	result = swap_read(pte->swapSlot, paddr);
+	if (result){
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return result;
+	}
+	swap_free(pte->swapSlot);
+	pt_setframe(as, pte, paddr);
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	return 0;
 }
 
-	void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+/*
+ * Give the faulting process its own copy of a copy-on-write page it
+ * is about to write. If nobody else maps the frame any more, it can
+ * simply be taken over. The caller looks at the pte again afterwards,
+ * since it may have been paged out before we got here.
+ */
+static
+	int
+vm_cowbreak(struct addrspace *as, struct pt_entry *pte)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	paddr_t old, paddr;
+	int i;
+
+	spinlock_acquire(&coremap_lock);
+	spinlock_acquire(&as->as_lock);
+	if (!pte->isValid || !pte->isCopyOnWrite){
+		spinlock_release(&as->as_lock);
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	old = pte->frame;
+	i = CM_INDEX(old);
+	if (coremap[i].refCount == 1){
+		pte->isCopyOnWrite = false;
+		spinlock_release(&as->as_lock);
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	// hold an extra reference so the frame can't be paged out while we copy it
+	coremap[i].refCount++;
+	spinlock_release(&as->as_lock);
+	spinlock_release(&coremap_lock);
+
+	paddr = getppages(1);
+	if (paddr != 0){
+		memcpy((void *)PADDR_TO_KVADDR(paddr),
+				(const void *)PADDR_TO_KVADDR(old), PAGE_SIZE);
+		spinlock_acquire(&as->as_lock);
+		pte->frame = paddr;
+		pte->isCopyOnWrite = false;
+		spinlock_release(&as->as_lock);
+		// drop our page table's reference to the shared frame
+		frame_release(old, as);
+		vmstats_inc(VMSTAT_COW_BREAK);
+	}
+	free_kpages(PADDR_TO_KVADDR(old));
+	return paddr == 0 ? ENOMEM : 0;
 }
+#endif
 
 	int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
+#if !OPT_A3
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+#endif
 	paddr_t paddr;
 	int i;
 	uint32_t ehi, elo;
@@ -195,7 +1237,8 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	switch (faulttype) {
 		case VM_FAULT_READONLY:
 #if OPT_A3
-			return EFAULT;
+			/* only legal on copy-on-write pages; checked below */
+			break;
 #else
 			/* We always create pages read-write, so we can't get this */
 			panic("dumbvm: got VM_FAULT_READONLY\n");
@@ -227,18 +1270,17 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	/* Assert that the address space has been set up properly. */
 #if OPT_A3
-	KASSERT(as->as_pt1 != NULL);
-	KASSERT(as->as_pt2 != NULL);
-	KASSERT(as->as_stackpt != NULL);
-	for (unsigned i = 0; i < as->as_npages1; i++){
-		KASSERT((as->as_pt1[i].frame & PAGE_FRAME) == as->as_pt1[i].frame);
-	}
-	for (unsigned i = 0; i < as->as_npages2; i++){
-		KASSERT((as->as_pt2[i].frame & PAGE_FRAME) == as->as_pt2[i].frame);
-	}
-	for (int i = 0; i < DUMBVM_STACKPAGES; i++){
-		KASSERT((as->as_stackpt[i].frame & PAGE_FRAME) == as->as_stackpt[i].frame);
+	KASSERT(as->as_pt != NULL);
+#if OPT_VMDEBUG
+	// walks every page table, so it costs far more than the fault itself
+	for (unsigned i1 = 0; i1 < PT_L1_SIZE; i1++){
+		struct pt_entry *pt = as->as_pt[i1];
+
+		for (unsigned i = 0; pt != NULL && i < PT_L2_SIZE; i++){
+			KASSERT((pt[i].frame & PAGE_FRAME) == pt[i].frame);
+		}
 	}
+#endif
 #else
 	KASSERT(as->as_pbase1 != 0);
 	KASSERT(as->as_pbase2 != 0);
@@ -255,6 +1297,75 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
 	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
 
+#if OPT_A3
+	bool isCodeSegment, isWritable;
+	bool isReload = true;
+	struct swtlb_entry *swe;
+	struct pt_entry *pte;
+	const struct elf_backing *eb;
+	int result;
+
+	swe = &as->as_swtlb[faultaddress / PAGE_SIZE % SWTLB_SIZE];
+	if (swe->vaddr == faultaddress && swe->pte != NULL){
+		pte = swe->pte;
+		isCodeSegment = swe->isCode;
+		vmstats_inc(VMSTAT_SWTLB_HIT);
+	}else{
+		if (!vm_region(as, faultaddress, NULL, &isCodeSegment) &&
+				!vm_growstack(as, faultaddress)){
+			return EFAULT;
+		}
+		pte = pt_walk(as, faultaddress, true);
+		if (pte == NULL){
+			return ENOMEM;
+		}
+		swe->vaddr = faultaddress;
+		swe->pte = pte;
+		swe->isCode = isCodeSegment;
+	}
+	isWritable = !(isCodeSegment && as->isLoadComplete);
+	if (faulttype == VM_FAULT_READONLY && !isWritable){
+		// a real write to the text segment
+		return EFAULT;
+	}
+
+	/*
+	 * Get the page resident and, for writes, unshared. Every step may
+	 * sleep, and the page can be paged out again in the meantime, so
+	 * go round until it's all true at once under as_lock; the TLB is
+	 * loaded before letting go of it, so a later page-out's shootdown
+	 * is sure to see the entry.
+	 */
+	for (;;){
+		spinlock_acquire(&as->as_lock);
+		if (pte->isBusy){
+			vm_pagewait(as);
+			continue;
+		}
+		if (!pte->isValid){
+			spinlock_release(&as->as_lock);
+			isReload = false;
+			if (pte->isSwapped){
+				result = vm_swapin(as, pte);
+			}else if (!vm_region(as, faultaddress, &eb, NULL)){
+				// a cached heap page that sbrk has since taken away
+				return EFAULT;
+			}else{
+				result = vm_pagein(as, eb, pte, faultaddress);
+			}
+		}else if (pte->isCopyOnWrite && faulttype != VM_FAULT_READ){
+			// split a shared page now rather than taking a second fault for the write
+			spinlock_release(&as->as_lock);
+			result = vm_cowbreak(as, pte);
+		}else{
+			break;
+		}
+		if (result){
+			return result;
+		}
+	}
+	paddr = pte->frame;
+#else
 	vbase1 = as->as_vbase1;
 	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
 	vbase2 = as->as_vbase2;
@@ -262,42 +1373,71 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
 	stacktop = USERSTACK;
 
-#if OPT_A3        
-	bool isCodeSegment = false; 
-#endif
-	if (faultaddress >= vbase1 && faultaddress < vtop1) { // TEXT SEGMENT
-#if OPT_A3
-		isCodeSegment = true;
-		int i = (faultaddress - vbase1) / PAGE_SIZE;
-		paddr = as->as_pt1[i].frame;
-#else
+	if (faultaddress >= vbase1 && faultaddress < vtop1) {
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
-#endif
 	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) { // DATA SEGMENT
-#if OPT_A3
-		int i = (faultaddress - vbase2) / PAGE_SIZE;
-		paddr = as->as_pt2[i].frame;
-#else
+	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
 		paddr = (faultaddress - vbase2) + as->as_pbase2;
-#endif
 	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) { // STACK SEGMENT
-#if OPT_A3
-		int i = (faultaddress - stackbase) / PAGE_SIZE;
-		paddr = as->as_stackpt[i].frame;
-#else
-		paddr = (faultaddress - stackbase) + as->as_as_stackbase;
-#endif
+	else if (faultaddress >= stackbase && faultaddress < stacktop) {
+		paddr = (faultaddress - stackbase) + as->as_stackpbase;
 	}
 	else {
 		return EFAULT;
 	}
+#endif
 
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
+#if OPT_A3
+	ehi = faultaddress | (curcpu->c_asid << TLBHI_PIDSHIFT);
+	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	if (!isWritable || pte->isCopyOnWrite){
+		elo &= ~TLBLO_DIRTY;
+	}
+	i = tlb_probe(ehi, 0);
+	if (i >= 0){
+		// write to a read-only entry: update it in place, never load a duplicate
+		tlb_write(ehi, elo, i);
+	}else{
+		vmstats_inc(VMSTAT_TLB_FAULT);
+		if (isReload){
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+		}
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_read(&ehi, &elo, i);
+			if (!(elo & TLBLO_VALID)) {
+				break;
+			}
+		}
+		// tlb_read clobbered the current PID; writing ehi puts it back
+		ehi = faultaddress | (curcpu->c_asid << TLBHI_PIDSHIFT);
+		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+		if (!isWritable || pte->isCopyOnWrite){
+			elo &= ~TLBLO_DIRTY;
+		}
+		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+		if (i < NUM_TLB){
+			vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+			tlb_write(ehi, elo, i);
+		}else{
+			vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+			tlb_random(ehi, elo);
+		}
+	}
+	splx(spl);
+	spinlock_release(&as->as_lock);
+
+	// a page that is ours alone can be paged out again from now on
+	if (coremap[CM_INDEX(paddr)].owner == NULL){
+		frame_setowner(paddr, as, faultaddress);
+	}
+	// only a hint for the clock hand, so no lock
+	coremap[CM_INDEX(paddr)].isReferenced = true;
+	return 0;
+#else
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_read(&ehi, &elo, i);
 		if (elo & TLBLO_VALID) {
@@ -305,33 +1445,143 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		}
 		ehi = faultaddress;
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-#if OPT_A3
-		if (isCodeSegment && as->isLoadComplete){
-			elo &= ~TLBLO_DIRTY;
-		}
-#endif
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
 		splx(spl);
 		return 0;
 	}
-#if OPT_A3
-	ehi = faultaddress;
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	if (isCodeSegment && as->isLoadComplete){
-		elo &= ~TLBLO_DIRTY;
-	}
-	tlb_random(ehi, elo);
-	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-	splx(spl);
-	return 0;
-#else
+
 	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
 	splx(spl);
 	return EFAULT;
 #endif
 }
 
+#if OPT_A3
+/*
+ * Release the frame or swap slot held by one of AS's ptes, waiting for
+ * any page-out still in progress.
+ */
+static
+	void
+pt_unmapentry(struct addrspace *as, struct pt_entry *pte)
+{
+	paddr_t frame;
+	bool isSwapped;
+
+	spinlock_acquire(&as->as_lock);
+	while (pte->isBusy){
+		vm_pagewait(as);
+		spinlock_acquire(&as->as_lock);
+	}
+	frame = pte->isValid ? pte->frame : 0;
+	isSwapped = pte->isSwapped;
+	pte->isValid = false;
+	pte->isSwapped = false;
+	pte->isCopyOnWrite = false;
+	spinlock_release(&as->as_lock);
+
+	if (frame != 0){
+		frame_release(frame, as);
+	}else if (isSwapped){
+		swap_free(pte->swapSlot);
+	}
+}
+
+/*
+ * Release everything AS's page tables map. The tables themselves are
+ * left for the caller to free.
+ */
+static
+	void
+pt_unmap(struct addrspace *as)
+{
+	struct pt_entry *pt;
+
+	for (unsigned i1 = 0; i1 < PT_L1_SIZE; i1++){
+		pt = as->as_pt[i1];
+		for (unsigned i = 0; pt != NULL && i < PT_L2_SIZE; i++){
+			pt_unmapentry(as, &pt[i]);
+		}
+	}
+}
+
+/*
+ * Make NEW map every page OLD has touched. Resident pages are shared:
+ * outside the text segment they become copy-on-write on both sides,
+ * and whichever process writes first gets its own copy in vm_fault.
+ * Pages out on swap get read back into a private frame for the child.
+ * Second-level tables are only created where OLD has them.
+ */
+static
+	int
+pt_share(struct addrspace *new, struct addrspace *old)
+{
+	struct pt_entry *src, *dst;
+	paddr_t paddr;
+	vaddr_t vaddr;
+	unsigned slot;
+	bool cow, isCode, isSwapped;
+	int result;
+
+	for (unsigned i1 = 0; i1 < PT_L1_SIZE; i1++){
+		src = old->as_pt[i1];
+		if (src == NULL){
+			continue;
+		}
+		dst = pt_walk(new, i1 * PT_L2_SIZE * PAGE_SIZE, true);
+		if (dst == NULL){
+			return ENOMEM;
+		}
+		for (unsigned i = 0; i < PT_L2_SIZE; i++){
+			vaddr = (i1 * PT_L2_SIZE + i) * PAGE_SIZE;
+			vm_region(old, vaddr, NULL, &isCode);
+			cow = !isCode;
+
+			spinlock_acquire(&coremap_lock);
+			spinlock_acquire(&old->as_lock);
+			while (src[i].isBusy){
+				spinlock_release(&coremap_lock);
+				vm_pagewait(old);
+				spinlock_acquire(&coremap_lock);
+				spinlock_acquire(&old->as_lock);
+			}
+			if (src[i].isValid){
+				coremap[CM_INDEX(src[i].frame)].refCount++;
+				if (cow){
+					src[i].isCopyOnWrite = true;
+				}
+				dst[i] = src[i];
+			}
+			isSwapped = src[i].isSwapped;
+			slot = src[i].swapSlot;
+			spinlock_release(&old->as_lock);
+			spinlock_release(&coremap_lock);
+
+			if (!isSwapped){
+				continue;
+			}
+			/*
+			 * The parent is busy forking, so nothing else touches its
+			 * swapped-out pages. Not a page fault, so not counted as one.
+			 */
+			paddr = getppages(1);
+			if (paddr == 0){
+				return ENOMEM;
+			}
+			result = swap_read(slot, paddr);
+			if (result){
+				free_kpages(PADDR_TO_KVADDR(paddr));
+				return result;
+			}
+			pt_setframe(new, &dst[i], paddr);
+			frame_setowner(paddr, new, vaddr);
+		}
+	}
+	return 0;
+}
+#endif
+
 	struct addrspace *
 as_create(void)
 {
@@ -340,10 +1590,31 @@ as_create(void)
 		return NULL;
 	}
 #if OPT_A3
+	// second-level tables come and go by the page
+	KASSERT(PT_L2_SIZE * sizeof(struct pt_entry) == PAGE_SIZE);
+	as->as_pt = kmalloc(PT_L1_SIZE * sizeof(struct pt_entry *));
+	if (as->as_pt == NULL){
+		kfree(as);
+		return NULL;
+	}
+	for (unsigned i1 = 0; i1 < PT_L1_SIZE; i1++){
+		as->as_pt[i1] = NULL;
+	}
+	as->as_stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+	as->as_heapbase = 0;
+	as->as_heaptop = 0;
+	for (unsigned i = 0; i < SWTLB_SIZE; i++){
+		as->as_swtlb[i].vaddr = SWTLB_EMPTY;
+		as->as_swtlb[i].pte = NULL;
+		as->as_swtlb[i].isCode = false;
+	}
+	as->as_asid = 0;
+	as->as_asidgen = 0;
 	as->isLoadComplete = false;
-	as->as_stackpt = NULL; // A3 uses page tables
-	as->as_pt1 = NULL;
-	as->as_pt2 = NULL;
+	as->as_vnode = NULL;
+	bzero(&as->as_elf1, sizeof(as->as_elf1));
+	bzero(&as->as_elf2, sizeof(as->as_elf2));
+	spinlock_init(&as->as_lock);
 #else
 	as->as_pbase1 = 0;
 	as->as_pbase2 = 0;
@@ -360,26 +1631,20 @@ as_create(void)
 as_destroy(struct addrspace *as)
 {
 #if OPT_A3
-	// empty page tables
-	for (unsigned i = 0; i < as->as_npages1; i++){
-		if (as->as_pt1[i].isValid){
-			free_kpages(PADDR_TO_KVADDR(as->as_pt1[i].frame));
-		}
-	}
-	for (unsigned i = 0; i < as->as_npages2; i++){
-		if (as->as_pt2[i].isValid){
-			free_kpages(PADDR_TO_KVADDR(as->as_pt2[i].frame));
-		}
+	/*
+	 * Empty the page tables before freeing any of them: until the
+	 * last frame is released the page-out code may still look up
+	 * this address space's ptes.
+	 */
+	pt_unmap(as);
+	for (unsigned i1 = 0; i1 < PT_L1_SIZE; i1++){
+		kfree(as->as_pt[i1]);
 	}
-	for (int i = 0; i < DUMBVM_STACKPAGES; i++){
-		if (as->as_stackpt[i].isValid){
-			free_kpages(PADDR_TO_KVADDR(as->as_stackpt[i].frame));
-		}
+	kfree(as->as_pt);
+	if (as->as_vnode != NULL){
+		VOP_DECREF(as->as_vnode);
 	}
-	// free page tables
-	kfree(as->as_pt1);
-	kfree(as->as_pt2);
-	kfree(as->as_stackpt);
+	spinlock_cleanup(&as->as_lock);
 	kfree(as);
 #else
 	kfree(as);
@@ -391,6 +1656,9 @@ as_activate(void)
 {
 	int i, spl;
 	struct addrspace *as;
+#if OPT_A3
+	unsigned asid, gen;
+#endif
 
 	as = curproc_getas();
 #ifdef UW
@@ -400,12 +1668,39 @@ as_activate(void)
 		return;
 	}
 
+#if OPT_A3
+	spinlock_acquire(&asid_lock);
+	if (as->as_asidgen != asid_gen){
+		if (asid_next == NUM_TLBPID){
+			asid_gen++;
+			asid_next = 1;
+		}
+		as->as_asid = asid_next++;
+		as->as_asidgen = asid_gen;
+	}
+	asid = as->as_asid;
+	gen = as->as_asidgen;
+	spinlock_release(&asid_lock);
+#endif
+
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+#if OPT_A3
+	if (curcpu->c_asidgen != gen){
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+		curcpu->c_asidgen = gen;
+		vm_tlbstat(VMSTAT_TLB_INVALIDATE_WRAP);
+	}
+	curcpu->c_asid = asid;
+	tlb_setpid(asid);
+#else
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
+#endif
 
 	splx(spl);
 }
@@ -438,26 +1733,12 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	if (as->as_vbase1 == 0) {
 		as->as_vbase1 = vaddr;
-#if OPT_A3
-		// alloc page table
-		as->as_pt1 = (struct pt_entry *)(kmalloc(npages * sizeof(struct pt_entry)));
-		if (as->as_pt1 == NULL){
-			return ENOMEM;
-		}
-#endif
 		as->as_npages1 = npages;
 		return 0;
 	}
 
 	if (as->as_vbase2 == 0) {
 		as->as_vbase2 = vaddr;		
-#if OPT_A3
-		// alloc page table
-		as->as_pt2 = (struct pt_entry *)(kmalloc(npages * sizeof(struct pt_entry)));
-		if (as->as_pt2 == NULL){
-			return ENOMEM;
-		}
-#endif
 		as->as_npages2 = npages;
 		return 0;
 	}
@@ -468,78 +1749,37 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return EUNIMP;
 }
 
-static
-	void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
-}
-
 	int
 as_prepare_load(struct addrspace *as)
 {
 #if OPT_A3
-	KASSERT(as->as_stackpt == NULL);
+	/*
+	 * Nothing is allocated up front any more: text and data pages
+	 * are read in from the executable by vm_fault the first time
+	 * they're touched, and stack pages are zero-filled the same way.
+	 * Even page tables only appear as pages get used.
+	 */
+	(void)as;
 #else
 	KASSERT(as->as_pbase1 == 0);
 	KASSERT(as->as_pbase2 == 0);
 	KASSERT(as->as_stackpbase == 0);
-#endif 
 
-	// TEXT SEGMENT
-#if OPT_A3
-	for (unsigned i = 0; i < as->as_npages1; i++){
-		as->as_pt1[i].frame = getppages(1);
-		as->as_pt1[i].isValid = !(as->as_pt1[i].frame == 0);
-	}
-#else
-	as->as_pbase1 = getppages(as->as_npages1);	
+	as->as_pbase1 = getppages(as->as_npages1);
 	if (as->as_pbase1 == 0) {
 		return ENOMEM;
 	}
-#endif
-
 
-	// DATA SEGMENT
-#if OPT_A3
-	for (unsigned i = 0; i < as->as_npages2; i++){
-		as->as_pt2[i].frame = getppages(1);
-		as->as_pt2[i].isValid = !(as->as_pt2[i].frame == 0);
-	}
-#else
 	as->as_pbase2 = getppages(as->as_npages2);
 	if (as->as_pbase2 == 0) {
 		return ENOMEM;
 	}
-#endif
 
-	// STACK SEGMENT	 
-	as->as_stackpt = (struct pt_entry *)(kmalloc(DUMBVM_STACKPAGES * sizeof(struct pt_entry)));
-	if (as->as_stackpt == NULL){
-		return ENOMEM;
-	}
-#if OPT_A3
-	for (int i = 0; i < DUMBVM_STACKPAGES; i++){
-		as->as_stackpt[i].frame = getppages(1);
-		as->as_stackpt[i].isValid = !(as->as_stackpt[i].frame == 0);
-	}
-#else
 	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
 	if (as->as_stackpbase == 0) {
 		return ENOMEM;
 	}
-#endif
-#if OPT_A3
-	for (unsigned i = 0; i < as->as_npages1; i++){
-		as_zero_region(as->as_pt1[i].frame, 1);
-	}
-	for (unsigned i = 0; i < as->as_npages2; i++){
-		as_zero_region(as->as_pt2[i].frame, 1);
-	}
-	for (int i = 0; i < DUMBVM_STACKPAGES; i++){
-		as_zero_region(as->as_stackpt[i].frame, 1);
-	}
-#else	
+
 	as_zero_region(as->as_pbase1, as->as_npages1);
 	as_zero_region(as->as_pbase2, as->as_npages2);
 	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
@@ -550,15 +1790,103 @@ as_prepare_load(struct addrspace *as)
 	int
 as_complete_load(struct addrspace *as)
 {
+#if OPT_A3
+	vaddr_t top1 = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+	vaddr_t top2 = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+
+	// the heap starts out empty, on the page after the highest segment
+	as->as_heapbase = top1 > top2 ? top1 : top2;
+	as->as_heaptop = as->as_heapbase;
+#else
 	(void)as;
+#endif
+	return 0;
+}
+
+#if OPT_A3
+	int
+as_define_backing(struct addrspace *as, struct vnode *v,
+		off_t offset, vaddr_t vaddr, size_t filesize)
+{
+	struct elf_backing *eb;
+
+	if (vaddr >= as->as_vbase1 &&
+			vaddr < as->as_vbase1 + as->as_npages1 * PAGE_SIZE){
+		eb = &as->as_elf1;
+	}else if (vaddr >= as->as_vbase2 &&
+			vaddr < as->as_vbase2 + as->as_npages2 * PAGE_SIZE){
+		eb = &as->as_elf2;
+	}else{
+		return EINVAL;
+	}
+
+	// hold on to the executable for as long as pages may come from it
+	if (as->as_vnode == NULL){
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	KASSERT(as->as_vnode == v);
+
+	eb->vaddr = vaddr;
+	eb->offset = offset;
+	eb->filesize = filesize;
+	return 0;
+}
+
+/*
+ * Heap pages are zero-filled on first touch, so growing the heap only
+ * moves the break. It may not come within DUMBVM_STACKMAX of the top
+ * of the stack, nor get bigger than all of memory plus swap, so
+ * malloc gets ENOMEM where it would otherwise run the process out of
+ * memory later on a fault. Shrinking frees whole pages above the new
+ * break straight away.
+ */
+	int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldtop)
+{
+	vaddr_t top = as->as_heaptop;
+	vaddr_t newtop = top + amount;
+	unsigned used, total;
+	struct pt_entry *pte;
+
+	KASSERT(as->as_heapbase != 0);
+
+	if (amount < 0){
+		if ((vaddr_t)-amount > top - as->as_heapbase){
+			return EINVAL;
+		}
+	}else if (amount > 0){
+		swap_usage(&used, &total);
+		if (newtop < top || newtop > USERSTACK - DUMBVM_STACKMAX ||
+				(newtop - as->as_heapbase) / PAGE_SIZE >
+				(vaddr_t)numberOfPages + total){
+			return ENOMEM;
+		}
+	}
+
+	as->as_heaptop = newtop;
+	if (ROUNDUP(newtop, PAGE_SIZE) < ROUNDUP(top, PAGE_SIZE)){
+		for (vaddr_t va = ROUNDUP(newtop, PAGE_SIZE);
+				va < ROUNDUP(top, PAGE_SIZE); va += PAGE_SIZE){
+			pte = pt_walk(as, va, false);
+			if (pte != NULL){
+				pt_unmapentry(as, pte);
+			}
+		}
+		// kill the old mappings wherever they are cached
+		vm_retireasid(as);
+		as_activate();
+	}
+	*oldtop = top;
 	return 0;
 }
+#endif
 
 	int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
 #if OPT_A3
-	KASSERT(as->as_stackpt != NULL);
+	KASSERT(as->as_pt != NULL);
 #else
 	KASSERT(as->as_stackpbase != 0);
 #endif
@@ -570,7 +1898,7 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 as_define_args(struct addrspace *as, char **args, int argc, vaddr_t *stackptr)
 {
 #if OPT_A3
-	KASSERT(as->as_stackpt != NULL);
+	KASSERT(as->as_pt != NULL);
 #else
 	KASSERT(as->as_stackpbase != 0);
 #endif
@@ -611,6 +1939,9 @@ as_define_args(struct addrspace *as, char **args, int argc, vaddr_t *stackptr)
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+#if OPT_A3
+	int result;
+#endif
 
 	new = as_create();
 	if (new==NULL) {
@@ -623,34 +1954,37 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	new->as_npages2 = old->as_npages2;
 
 #if OPT_A3
-	// alloc page tables
-	new->as_pt1 = (struct pt_entry *)(kmalloc(new->as_npages1 * sizeof(struct pt_entry)));
-	new->as_pt2 = (struct pt_entry *)(kmalloc(new->as_npages2 * sizeof(struct pt_entry)));
-	new->as_stackpt = (struct pt_entry *)(kmalloc(DUMBVM_STACKPAGES * sizeof(struct pt_entry)));
-	if (new->as_pt1 == NULL || new->as_pt2 == NULL || new->as_stackpt == NULL){
-		return ENOMEM;
+	new->isLoadComplete = old->isLoadComplete;
+	new->as_elf1 = old->as_elf1;
+	new->as_elf2 = old->as_elf2;
+	if (old->as_vnode != NULL){
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
+	}
+
+	new->as_stackbase = old->as_stackbase;
+	new->as_heapbase = old->as_heapbase;
+	new->as_heaptop = old->as_heaptop;
+
+	/*
+	 * Nothing is copied here. Resident pages are shared with the
+	 * child (text read-only as always, data and stack copy-on-write);
+	 * pages the parent never touched stay unloaded in the child too
+	 * and get paged in from the executable when it first uses them.
+	 */
+	result = pt_share(new, old);
+
+	/*
+	 * The parent may still have writable TLB entries, on any cpu it
+	 * has run on, for what is now shared.
+	 */
+	vm_retireasid(old);
+	if (old == curproc_getas()){
+		as_activate();
 	}
-	// get frames for page tables and copy frame data from old address space 
-	for (unsigned i = 0; i < new->as_npages1; i++){
-		new->as_pt1[i].frame = getppages(1);
-		new->as_pt1[i].isValid = !(new->as_pt1[i].frame == 0);
-		memcpy((void *)PADDR_TO_KVADDR(new->as_pt1[i].frame),
-				(const void *)PADDR_TO_KVADDR(old->as_pt1[i].frame),
-				PAGE_SIZE);
-	}	 
-	for (unsigned i = 0; i < new->as_npages2; i++){
-		new->as_pt2[i].frame = getppages(1);
-		new->as_pt2[i].isValid = !(new->as_pt2[i].frame == 0);
-		memcpy((void *)PADDR_TO_KVADDR(new->as_pt2[i].frame),
-				(const void *)PADDR_TO_KVADDR(old->as_pt2[i].frame),
-				PAGE_SIZE);
-	}
-	for (int i = 0; i < DUMBVM_STACKPAGES; i++){
-		new->as_stackpt[i].frame = getppages(1);
-		new->as_stackpt[i].isValid = !(new->as_stackpt[i].frame == 0);
-		memcpy((void *)PADDR_TO_KVADDR(new->as_stackpt[i].frame),
-				(const void *)PADDR_TO_KVADDR(old->as_stackpt[i].frame),
-				PAGE_SIZE);
+	if (result){
+		as_destroy(new);
+		return result;
 	}
 #else
 	/* (Mis)use as_prepare_load to allocate some physical memory. */
@@ -35,7 +35,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -59,6 +59,9 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Most sectors lhd_io moves per request when it has to copy */
+#define LHD_BOUNCESECT  8
+
 /*
  * Shortcut for reading a register.
  */
@@ -95,41 +98,125 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the disk on the next sector of the current request, first
+ * asking the scheduler for a new current request if there isn't one.
+ * Does nothing if there is no more work.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_start(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct ioreq *req;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_cur == NULL) {
+		lh->lh_cur = iosched_next(&lh->lh_sched);
+		if (lh->lh_cur == NULL) {
+			return;
+		}
+	}
+	req = lh->lh_cur;
+	KASSERT(req->ir_ndone < req->ir_nsect);
+
+	/* If writing, the data has to be on the card first. */
+	if (req->ir_write) {
+		memcpy(lh->lh_buf,
+		       (char *)req->ir_buf + req->ir_ndone*LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	lhd_wreg(lh, LHD_REG_SECT, req->ir_sector + req->ir_ndone);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, collect the sector, and start the next one. If that was
+ * the end of a request (or it failed), report completion.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct ioreq *req, *done = NULL;
 	uint32_t val;
-	
+	int result;
+
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
-	    case LHD_IDLE:
-	    case LHD_WORKING:
-		break;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
-		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
+	    default:
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+	lhd_wreg(lh, LHD_REG_STAT, 0);
+	result = lhd_code_to_errno(lh, val);
+
+	req = lh->lh_cur;
+	if (req == NULL) {
+		/* Nothing was outstanding */
+		spinlock_release(&lh->lh_lock);
+		return;
 	}
+
+	if (result == 0) {
+		if (!req->ir_write) {
+			memcpy((char *)req->ir_buf +
+			       req->ir_ndone*LHD_SECTSIZE,
+			       lh->lh_buf, LHD_SECTSIZE);
+		}
+		req->ir_ndone++;
+	}
+	if (result != 0 || req->ir_ndone == req->ir_nsect) {
+		/* Carry on with the rest of a merged run, if any */
+		lh->lh_cur = req->ir_merged;
+		done = req;
+	}
+
+	/* Keep the disk busy. */
+	lhd_start(lh);
+
+	spinlock_release(&lh->lh_lock);
+
+	/* The callback may well submit more requests, so unlocked. */
+	if (done != NULL) {
+		done->ir_callback(done, result);
+	}
+}
+
+/*
+ * Queue a request, starting the disk if it is idle.
+ */
+int
+lhd_submit(struct lhd_softc *lh, struct ioreq *req)
+{
+	/* Don't allow I/O past the end of the disk. */
+	if (req->ir_nsect == 0 ||
+	    req->ir_sector >= lh->lh_dev.d_blocks ||
+	    req->ir_nsect > lh->lh_dev.d_blocks - req->ir_sector) {
+		return EINVAL;
+	}
+
+	req->ir_ndone = 0;
+
+	spinlock_acquire(&lh->lh_lock);
+	iosched_add(&lh->lh_sched, req);
+	if (lh->lh_cur == NULL) {
+		lhd_start(lh);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
 }
 
 /*
@@ -193,8 +280,85 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * d_submit: lhd sectors are the device's blocks.
+ */
+static
+int
+lhd_dsubmit(struct device *d, struct ioreq *req)
+{
+	return lhd_submit(d->d_data, req);
+}
+
+/*
+ * What lhd_io waits on. lw_done is only looked at with lh_wchan
+ * locked, so once the waiter sees it set the interrupt handler is
+ * done with this structure.
+ */
+struct lhd_wait {
+	struct lhd_softc *lw_lh;
+	bool lw_done;
+	int lw_result;
+};
+
+static
+void
+lhd_wakeup(struct ioreq *req, int result)
+{
+	struct lhd_wait *w = req->ir_data;
+	struct wchan *wc = w->lw_lh->lh_wchan;
+
+	wchan_lock(wc);
+	w->lw_result = result;
+	w->lw_done = true;
+	wchan_unlock(wc);
+	wchan_wakeall(wc);
+}
+
+/*
+ * Do one request and wait for it to finish.
+ */
+static
+int
+lhd_syncio(struct lhd_softc *lh, uint32_t sector, uint32_t nsect,
+	   void *buf, bool iswrite)
+{
+	struct ioreq req;
+	struct lhd_wait w;
+	int result;
+
+	w.lw_lh = lh;
+	w.lw_done = false;
+	w.lw_result = 0;
+
+	req.ir_sector = sector;
+	req.ir_nsect = nsect;
+	req.ir_buf = buf;
+	req.ir_write = iswrite;
+	req.ir_callback = lhd_wakeup;
+	req.ir_data = &w;
+
+	result = lhd_submit(lh, &req);
+	if (result) {
+		return result;
+	}
+
+	wchan_lock(lh->lh_wchan);
+	while (!w.lw_done) {
+		wchan_sleep(lh->lh_wchan);
+		wchan_lock(lh->lh_wchan);
+	}
+	wchan_unlock(lh->lh_wchan);
+
+	return w.lw_result;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * A transfer to or from a single kernel buffer goes to the disk as
+ * one request. Anything else is moved through a bounce buffer a few
+ * sectors at a time, since the interrupt handler can't do uiomove.
  */
 static
 int
@@ -206,8 +370,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool iswrite = (uio->uio_rw == UIO_WRITE);
+	struct iovec *iov;
+	char *bounce;
+	uint32_t n;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,59 +386,60 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	iov = uio->uio_iov;
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1 &&
+	    iov->iov_len >= uio->uio_resid) {
+		result = lhd_syncio(lh, sector, len, iov->iov_kbase, iswrite);
+		if (result) {
+			return result;
+		}
+		/* Account for the transfer as uiomove would have */
+		n = len * LHD_SECTSIZE;
+		iov->iov_kbase = (char *)iov->iov_kbase + n;
+		iov->iov_len -= n;
+		uio->uio_offset += n;
+		uio->uio_resid -= n;
+		return 0;
+	}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	bounce = kmalloc(LHD_BOUNCESECT * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	result = 0;
+	while (len > 0) {
+		n = len < LHD_BOUNCESECT ? len : LHD_BOUNCESECT;
+
+		if (iswrite) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		result = lhd_syncio(lh, sector, n, bounce, iswrite);
+		if (result) {
+			break;
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+		if (!iswrite) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
+
+		sector += n;
+		len -= n;
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 /*
@@ -282,6 +449,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	char *schedname;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -289,23 +457,29 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_cur = NULL;
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	schedname = kstrdup(name);
+	if (schedname == NULL) {
+		wchan_destroy(lh->lh_wchan);
+		lh->lh_wchan = NULL;
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
+	iosched_init(&lh->lh_sched, schedname, &lh->lh_lock);
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
 	lh->lh_dev.d_close = lhd_close;
 	lh->lh_dev.d_io = lhd_io;
 	lh->lh_dev.d_ioctl = lhd_ioctl;
+	lh->lh_dev.d_submit = lhd_dsubmit;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
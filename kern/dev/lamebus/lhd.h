@@ -30,7 +30,9 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
+#include <iosched.h>
 
 /*
  * Our sector size
@@ -51,9 +53,10 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the request queue */
+	struct ioreq *lh_cur;		/* Request the disk is working on */
+	struct iosched lh_sched;	/* Requests waiting for the disk */
+	struct wchan *lh_wchan;		/* Where lhd_io waits for requests */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +64,14 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/*
+ * Queue an I/O request; fails only if the request is out of range.
+ * The disk only moves one sector at a time, so the interrupt handler
+ * copies each sector in or out of ir_buf and starts the next one
+ * itself. When the whole request is done (or a sector fails)
+ * ir_callback is called, from interrupt context, with the result.
+ * The request must not be touched until then.
+ */
+int lhd_submit(struct lhd_softc *lh, struct ioreq *req);
+
 #endif /* _LAMEBUS_LHD_H_ */
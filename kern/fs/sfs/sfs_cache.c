@@ -0,0 +1,877 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Block buffer cache.
+ *
+ * Inodes, indirect blocks, directory blocks and file data all go
+ * through here rather than straight to the device. Buffers are found
+ * by (filesystem, block number) through a small hash table; the ones
+ * nobody is using sit on an LRU list, and when the cache is full the
+ * least recently used of those is written back (if dirty) and reused.
+ *
+ * A buffer handed out by sfs_buf_read or sfs_buf_get is pinned and
+ * stays put until the caller hands it back with sfs_buf_release.
+ * Modified buffers are marked dirty and only reach the disk when
+ * evicted or when the filesystem is synced.
+ *
+ * The superblock and the free block bitmap are kept in struct sfs_fs
+ * and do not use the cache.
+ *
+ * sfs_buf_prefetch starts reading a block without waiting for it,
+ * if the device can do that. Until the read finishes the buffer is
+ * pinned by the I/O and sits on the in-flight list; anyone who wants
+ * it waits. Finished reads are collected (the interrupt handler that
+ * reports them can't touch the lists) the next time we come through.
+ *
+ * Everything here is protected by sfs_buflock, except the completion
+ * flags of in-flight buffers, which go with sfs_bufwchan's lock.
+ * sfs_buflock is never held across disk I/O: a thread reading or
+ * writing a buffer marks it busy and pins it, lets go of the lock,
+ * and anyone else who wants the buffer waits on sfs_bufcv. What is in
+ * a pinned buffer belongs to whoever pinned it; callers see to it
+ * (through their vnode locks) that two of them never use the same
+ * block at once.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <wchan.h>
+#include <device.h>
+#include <iosched.h>
+#include <sfs.h>
+
+/* Most buffers we'll allocate; they are allocated as needed */
+#define SFS_BUF_MAX      128
+
+/* Hash table size; a power of two */
+#define SFS_BUF_NHASH    64
+
+struct sfs_buf {
+	struct sfs_fs *sb_fs;		/* filesystem the block belongs to */
+	uint32_t sb_block;		/* block number */
+	bool sb_valid;			/* sb_data holds the block's contents */
+	bool sb_dirty;			/* sb_data differs from the disk */
+	unsigned sb_pincount;		/* outstanding read/get calls */
+	bool sb_busy;			/* a thread is doing I/O on it */
+	bool sb_prefetched;		/* read ahead, not asked for yet */
+	bool sb_inflight;		/* prefetch read in progress */
+	bool sb_iodone;			/* ...which has finished */
+	int sb_ioresult;		/* ...with this result */
+	struct ioreq sb_ioreq;		/* for the prefetch read */
+	struct sfs_buf *sb_hashnext;	/* hash chain */
+	struct sfs_buf *sb_lruprev;	/* LRU list, only while unpinned */
+	struct sfs_buf *sb_lrunext;	/* (or the in-flight list) */
+	char sb_data[SFS_BLOCKSIZE];
+};
+
+static struct sfs_buf *sfs_bufhash[SFS_BUF_NHASH];
+static unsigned sfs_bufcount;
+
+static struct lock *sfs_buflock;
+static struct cv *sfs_bufcv;		/* for busy buffers */
+
+/* Buffers being prefetched, and where to wait for them */
+static struct sfs_buf *sfs_bufinflight;
+static struct wchan *sfs_bufwchan;
+
+/* Unpinned buffers, least recently used first */
+static struct sfs_buf *sfs_lruhead, *sfs_lrutail;
+
+/* Statistics */
+static unsigned sfs_bufhits;
+static unsigned sfs_bufmisses;
+static unsigned sfs_bufevictions;
+static unsigned sfs_bufwritebacks;	/* dirty buffers written on eviction */
+static unsigned sfs_bufsyncwrites;	/* dirty buffers written by sync */
+static unsigned sfs_bufprefetches;	/* prefetch reads started */
+static unsigned sfs_bufprefetchhits;	/* ...whose block was then read */
+static unsigned sfs_bufprefetchwaits;	/* ...while still in flight */
+static unsigned sfs_bufprefetchunused;	/* ...dropped without being read */
+
+////////////////////////////////////////////////////////////
+//
+// Setup
+
+/*
+ * Create the locks, the first time a filesystem is mounted. (Mounts
+ * are serialized by the VFS layer.)
+ */
+int
+sfs_buf_init(void)
+{
+	if (sfs_buflock != NULL) {
+		return 0;
+	}
+
+	sfs_bufwchan = wchan_create("sfsbuf");
+	if (sfs_bufwchan == NULL) {
+		return ENOMEM;
+	}
+	sfs_bufcv = cv_create("sfsbuf");
+	if (sfs_bufcv == NULL) {
+		wchan_destroy(sfs_bufwchan);
+		sfs_bufwchan = NULL;
+		return ENOMEM;
+	}
+	sfs_buflock = lock_create("sfsbuf");
+	if (sfs_buflock == NULL) {
+		cv_destroy(sfs_bufcv);
+		sfs_bufcv = NULL;
+		wchan_destroy(sfs_bufwchan);
+		sfs_bufwchan = NULL;
+		return ENOMEM;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Lists
+
+static
+unsigned
+sfs_buf_hash(struct sfs_fs *sfs, uint32_t block)
+{
+	return (block ^ ((uintptr_t)sfs >> 6)) & (SFS_BUF_NHASH - 1);
+}
+
+static
+void
+sfs_buf_lruremove(struct sfs_buf *b)
+{
+	if (b->sb_lruprev != NULL) {
+		b->sb_lruprev->sb_lrunext = b->sb_lrunext;
+	}
+	else {
+		sfs_lruhead = b->sb_lrunext;
+	}
+	if (b->sb_lrunext != NULL) {
+		b->sb_lrunext->sb_lruprev = b->sb_lruprev;
+	}
+	else {
+		sfs_lrutail = b->sb_lruprev;
+	}
+	b->sb_lruprev = b->sb_lrunext = NULL;
+}
+
+static
+void
+sfs_buf_lruappend(struct sfs_buf *b)
+{
+	b->sb_lruprev = sfs_lrutail;
+	b->sb_lrunext = NULL;
+	if (sfs_lrutail != NULL) {
+		sfs_lrutail->sb_lrunext = b;
+	}
+	else {
+		sfs_lruhead = b;
+	}
+	sfs_lrutail = b;
+}
+
+static
+void
+sfs_buf_hashremove(struct sfs_buf *b)
+{
+	struct sfs_buf **p;
+
+	p = &sfs_bufhash[sfs_buf_hash(b->sb_fs, b->sb_block)];
+	while (*p != b) {
+		KASSERT(*p != NULL);
+		p = &(*p)->sb_hashnext;
+	}
+	*p = b->sb_hashnext;
+	b->sb_hashnext = NULL;
+}
+
+static
+struct sfs_buf *
+sfs_buf_lookup(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+
+	b = sfs_bufhash[sfs_buf_hash(sfs, block)];
+	while (b != NULL && (b->sb_fs != sfs || b->sb_block != block)) {
+		b = b->sb_hashnext;
+	}
+	return b;
+}
+
+/* Get rid of a buffer that is on neither list. */
+static
+void
+sfs_buf_free(struct sfs_buf *b)
+{
+	if (b->sb_prefetched) {
+		sfs_bufprefetchunused++;
+	}
+	kfree(b);
+	sfs_bufcount--;
+}
+
+static
+void
+sfs_buf_pin(struct sfs_buf *b)
+{
+	if (b->sb_pincount == 0) {
+		sfs_buf_lruremove(b);
+	}
+	b->sb_pincount++;
+}
+
+/* Drop a pin; sfs_buf_release without the locking. */
+static
+void
+sfs_buf_unpin(struct sfs_buf *b)
+{
+	KASSERT(b->sb_pincount > 0);
+
+	b->sb_pincount--;
+	if (b->sb_pincount == 0) {
+		if (b->sb_valid) {
+			sfs_buf_lruappend(b);
+		}
+		else {
+			/* Nothing worth keeping; free up the slot */
+			sfs_buf_hashremove(b);
+			sfs_buf_free(b);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Prefetch completion
+
+/* Called from the device's interrupt handler. */
+static
+void
+sfs_buf_iodone(struct ioreq *req, int result)
+{
+	struct sfs_buf *b = req->ir_data;
+
+	wchan_lock(sfs_bufwchan);
+	b->sb_ioresult = result;
+	b->sb_iodone = true;
+	wchan_unlock(sfs_bufwchan);
+	wchan_wakeall(sfs_bufwchan);
+}
+
+static
+bool
+sfs_buf_isdone(struct sfs_buf *b)
+{
+	bool done;
+
+	wchan_lock(sfs_bufwchan);
+	done = b->sb_iodone;
+	wchan_unlock(sfs_bufwchan);
+	return done;
+}
+
+/*
+ * Finish off a completed prefetch: take it off the in-flight list and
+ * drop the I/O's pin. If the read failed the buffer goes away.
+ */
+static
+void
+sfs_buf_iofinish(struct sfs_buf *b)
+{
+	struct sfs_buf **p;
+
+	KASSERT(b->sb_inflight && b->sb_iodone);
+
+	for (p = &sfs_bufinflight; *p != b; p = &(*p)->sb_lrunext) {
+		KASSERT(*p != NULL);
+	}
+	*p = b->sb_lrunext;
+	b->sb_lrunext = NULL;
+
+	b->sb_inflight = false;
+	if (b->sb_ioresult == 0) {
+		b->sb_valid = true;
+		b->sb_prefetched = true;
+	}
+	sfs_buf_unpin(b);
+}
+
+/*
+ * Wait for a prefetch to complete, and finish it. The caller must
+ * have its own pin on the buffer, which is left alone.
+ */
+static
+void
+sfs_buf_iowait(struct sfs_buf *b)
+{
+	KASSERT(lock_do_i_hold(sfs_buflock));
+	KASSERT(b->sb_inflight && b->sb_pincount > 1);
+
+	lock_release(sfs_buflock);
+	wchan_lock(sfs_bufwchan);
+	while (!b->sb_iodone) {
+		wchan_sleep(sfs_bufwchan);
+		wchan_lock(sfs_bufwchan);
+	}
+	wchan_unlock(sfs_bufwchan);
+	lock_acquire(sfs_buflock);
+
+	/* Someone else may have collected it already */
+	if (b->sb_inflight) {
+		sfs_buf_iofinish(b);
+	}
+}
+
+/* Finish off any prefetches that have completed. */
+static
+void
+sfs_buf_reap(void)
+{
+	struct sfs_buf *b, *next;
+
+	for (b = sfs_bufinflight; b != NULL; b = next) {
+		next = b->sb_lrunext;
+		if (sfs_buf_isdone(b)) {
+			sfs_buf_iofinish(b);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Getting buffers
+
+/*
+ * Write out a dirty buffer nobody has pinned. sfs_buflock is dropped
+ * while the write is going on, so the caller must look again at
+ * whatever it was doing afterwards.
+ */
+static
+int
+sfs_buf_writeback(struct sfs_buf *b)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+	KASSERT(b->sb_valid && b->sb_dirty);
+	KASSERT(b->sb_pincount == 0);
+
+	sfs_buf_pin(b);
+	b->sb_busy = true;
+	lock_release(sfs_buflock);
+
+	result = sfs_wblock(b->sb_fs, b->sb_data, b->sb_block);
+
+	lock_acquire(sfs_buflock);
+	b->sb_busy = false;
+	if (result == 0) {
+		b->sb_dirty = false;
+	}
+	cv_broadcast(sfs_bufcv, sfs_buflock);
+	sfs_buf_unpin(b);
+	return result;
+}
+
+/*
+ * Find a buffer that isn't holding anything: a new one if we're
+ * under the limit, otherwise the least recently used unpinned one,
+ * after writing it back if necessary (unless NOWAIT says not to, in
+ * which case sfs_buflock is never dropped). The buffer returned is
+ * on neither list.
+ */
+static
+int
+sfs_buf_alloc(bool nowait, struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	if (sfs_bufcount < SFS_BUF_MAX) {
+		b = kmalloc(sizeof(struct sfs_buf));
+		if (b != NULL) {
+			sfs_bufcount++;
+			*ret = b;
+			return 0;
+		}
+		/* Out of kernel memory; try to reuse one instead */
+	}
+
+	while (1) {
+		b = sfs_lruhead;
+		if (b == NULL) {
+			/* Everything is pinned */
+			return ENOMEM;
+		}
+		KASSERT(b->sb_pincount == 0);
+		if (!b->sb_dirty) {
+			break;
+		}
+		if (nowait) {
+			return EAGAIN;
+		}
+		/* Write it back, then start over; things may have moved */
+		result = sfs_buf_writeback(b);
+		if (result) {
+			return result;
+		}
+		sfs_bufwritebacks++;
+	}
+	sfs_buf_lruremove(b);
+	sfs_buf_hashremove(b);
+	sfs_bufevictions++;
+	if (b->sb_prefetched) {
+		sfs_bufprefetchunused++;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+/* Set up a fresh buffer for BLOCK and put it in the hash table. */
+static
+void
+sfs_buf_attach(struct sfs_buf *b, struct sfs_fs *sfs, uint32_t block)
+{
+	unsigned h;
+
+	b->sb_fs = sfs;
+	b->sb_block = block;
+	b->sb_valid = false;
+	b->sb_dirty = false;
+	b->sb_pincount = 1;
+	b->sb_busy = false;
+	b->sb_prefetched = false;
+	b->sb_inflight = false;
+	b->sb_iodone = false;
+	b->sb_lruprev = b->sb_lrunext = NULL;
+
+	h = sfs_buf_hash(sfs, block);
+	b->sb_hashnext = sfs_bufhash[h];
+	sfs_bufhash[h] = b;
+}
+
+/*
+ * Find or set up the buffer for BLOCK and pin it, waiting out any I/O
+ * in progress on it. The contents are not necessarily valid. Called
+ * with sfs_buflock held, which may be dropped and retaken.
+ */
+static
+int
+sfs_buf_find(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+
+	sfs_buf_reap();
+
+	while (1) {
+		b = sfs_buf_lookup(sfs, block);
+		if (b != NULL) {
+			sfs_buf_pin(b);
+			if (b->sb_inflight) {
+				/* Being prefetched */
+				sfs_bufprefetchwaits++;
+				sfs_buf_iowait(b);
+			}
+			while (b->sb_busy) {
+				cv_wait(sfs_bufcv, sfs_buflock);
+			}
+			*ret = b;
+			return 0;
+		}
+
+		result = sfs_buf_alloc(false, &b);
+		if (result) {
+			return result;
+		}
+
+		/* If that had to write something back, look again */
+		if (sfs_buf_lookup(sfs, block) == NULL) {
+			break;
+		}
+		kfree(b);
+		sfs_bufcount--;
+	}
+	sfs_buf_attach(b, sfs, block);
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Get BLOCK, reading it from disk if it isn't already cached.
+ */
+int
+sfs_buf_read(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	lock_acquire(sfs_buflock);
+
+	result = sfs_buf_find(sfs, block, &b);
+	if (result) {
+		lock_release(sfs_buflock);
+		return result;
+	}
+
+	if (b->sb_valid) {
+		sfs_bufhits++;
+		if (b->sb_prefetched) {
+			sfs_bufprefetchhits++;
+			b->sb_prefetched = false;
+		}
+	}
+	else {
+		sfs_bufmisses++;
+		b->sb_busy = true;
+		lock_release(sfs_buflock);
+
+		result = sfs_rblock(sfs, b->sb_data, block);
+
+		lock_acquire(sfs_buflock);
+		b->sb_busy = false;
+		cv_broadcast(sfs_bufcv, sfs_buflock);
+		if (result) {
+			sfs_buf_unpin(b);
+			lock_release(sfs_buflock);
+			return result;
+		}
+		b->sb_valid = true;
+	}
+
+	lock_release(sfs_buflock);
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Get BLOCK without reading it, for callers that are about to
+ * overwrite all of it. If sfs_buf_valid says the contents aren't
+ * there, the caller must fill in the whole block before calling
+ * sfs_buf_markdirty.
+ */
+int
+sfs_buf_get(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	int result;
+
+	lock_acquire(sfs_buflock);
+	result = sfs_buf_find(sfs, block, ret);
+	if (result == 0) {
+		/* Overwriting it doesn't make the read ahead useful */
+		(*ret)->sb_prefetched = false;
+	}
+	lock_release(sfs_buflock);
+	return result;
+}
+
+/*
+ * Start reading BLOCK into the cache if it isn't there already,
+ * without waiting. This is only a hint: if the device can't do it,
+ * or no buffer can be had without writing one back, nothing happens.
+ */
+void
+sfs_buf_prefetch(struct sfs_fs *sfs, uint32_t block)
+{
+	struct device *dev = sfs->sfs_device;
+	struct sfs_buf *b;
+	int result;
+
+	if (dev->d_submit == NULL) {
+		return;
+	}
+
+	lock_acquire(sfs_buflock);
+
+	sfs_buf_reap();
+
+	if (sfs_buf_lookup(sfs, block) != NULL) {
+		lock_release(sfs_buflock);
+		return;
+	}
+	result = sfs_buf_alloc(true, &b);
+	if (result) {
+		lock_release(sfs_buflock);
+		return;
+	}
+	sfs_buf_attach(b, sfs, block);
+
+	/* The I/O holds the pin until sfs_buf_iofinish */
+	b->sb_inflight = true;
+	b->sb_ioreq.ir_sector = block;
+	b->sb_ioreq.ir_nsect = 1;
+	b->sb_ioreq.ir_buf = b->sb_data;
+	b->sb_ioreq.ir_write = false;
+	b->sb_ioreq.ir_callback = sfs_buf_iodone;
+	b->sb_ioreq.ir_data = b;
+	b->sb_lrunext = sfs_bufinflight;
+	sfs_bufinflight = b;
+
+	result = dev->d_submit(dev, &b->sb_ioreq);
+	if (result) {
+		/* Out of range; let the real read report it */
+		b->sb_ioresult = result;
+		b->sb_iodone = true;
+		sfs_buf_iofinish(b);
+		lock_release(sfs_buflock);
+		return;
+	}
+	sfs_bufprefetches++;
+
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Whether the cache has anything at all for BLOCK: a valid buffer,
+ * or one being read or written. I/O that goes around the cache has
+ * to stay clear of these.
+ */
+bool
+sfs_buf_present(struct sfs_fs *sfs, uint32_t block)
+{
+	bool ret;
+
+	lock_acquire(sfs_buflock);
+	ret = sfs_buf_lookup(sfs, block) != NULL;
+	lock_release(sfs_buflock);
+	return ret;
+}
+
+/*
+ * Whether BLOCK can be had from the cache without waiting.
+ */
+bool
+sfs_buf_iscached(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+	bool ret;
+
+	lock_acquire(sfs_buflock);
+	b = sfs_buf_lookup(sfs, block);
+	ret = b != NULL && b->sb_valid && !b->sb_inflight && !b->sb_busy;
+	lock_release(sfs_buflock);
+	return ret;
+}
+
+void *
+sfs_buf_data(struct sfs_buf *b)
+{
+	KASSERT(b->sb_pincount > 0);
+	return b->sb_data;
+}
+
+bool
+sfs_buf_valid(struct sfs_buf *b)
+{
+	return b->sb_valid;
+}
+
+/* The buffer was modified (and is now entirely valid). */
+void
+sfs_buf_markdirty(struct sfs_buf *b)
+{
+	KASSERT(b->sb_pincount > 0);
+	b->sb_valid = true;
+	b->sb_dirty = true;
+}
+
+/* Unpin a buffer. */
+void
+sfs_buf_release(struct sfs_buf *b)
+{
+	lock_acquire(sfs_buflock);
+	sfs_buf_unpin(b);
+	lock_release(sfs_buflock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Whole-cache operations
+
+/*
+ * BLOCK is being freed, or is about to be overwritten on disk
+ * directly; throw away any cached copy without writing it back. When
+ * freeing, this must happen before the block is marked free, or it
+ * could be handed out again and cached afresh first.
+ */
+void
+sfs_buf_forget(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+
+	lock_acquire(sfs_buflock);
+	while (1) {
+		b = sfs_buf_lookup(sfs, block);
+		if (b == NULL) {
+			break;
+		}
+		if (b->sb_inflight) {
+			sfs_buf_pin(b);
+			sfs_buf_iowait(b);
+			sfs_buf_unpin(b);
+			continue;
+		}
+		if (b->sb_busy) {
+			/* Being written back; wait, then look again */
+			cv_wait(sfs_bufcv, sfs_buflock);
+			continue;
+		}
+		KASSERT(b->sb_pincount == 0);
+		sfs_buf_lruremove(b);
+		sfs_buf_hashremove(b);
+		sfs_buf_free(b);
+		break;
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Write back all dirty buffers belonging to SFS. Buffers somebody has
+ * pinned are in the middle of being changed and are left for next
+ * time. Stops at the first error.
+ */
+int
+sfs_buf_sync(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b;
+	unsigned i;
+	int result;
+
+	lock_acquire(sfs_buflock);
+	for (i=0; i<SFS_BUF_NHASH; i++) {
+		b = sfs_bufhash[i];
+		while (b != NULL) {
+			if (b->sb_fs != sfs || !b->sb_dirty ||
+			    b->sb_pincount > 0) {
+				b = b->sb_hashnext;
+				continue;
+			}
+			result = sfs_buf_writeback(b);
+			if (result) {
+				lock_release(sfs_buflock);
+				return result;
+			}
+			sfs_bufsyncwrites++;
+
+			/* The chain may have changed meanwhile */
+			b = sfs_bufhash[i];
+		}
+	}
+	lock_release(sfs_buflock);
+	return 0;
+}
+
+/*
+ * Drop all buffers belonging to SFS, which is being unmounted and
+ * has just been synced.
+ */
+void
+sfs_buf_dropfs(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b, *next;
+
+	lock_acquire(sfs_buflock);
+
+	/* Let any reads ahead finish first */
+ again:
+	for (b = sfs_bufinflight; b != NULL; b = b->sb_lrunext) {
+		if (b->sb_fs == sfs) {
+			sfs_buf_pin(b);
+			sfs_buf_iowait(b);
+			sfs_buf_unpin(b);
+			goto again;
+		}
+	}
+
+	for (b = sfs_lruhead; b != NULL; b = next) {
+		next = b->sb_lrunext;
+		if (b->sb_fs != sfs) {
+			continue;
+		}
+		KASSERT(!b->sb_dirty);
+		sfs_buf_lruremove(b);
+		sfs_buf_hashremove(b);
+		sfs_buf_free(b);
+	}
+
+	lock_release(sfs_buflock);
+}
+
+void
+sfs_buf_printstats(void)
+{
+	struct sfs_buf *b;
+	unsigned i, dirty = 0, pinned = 0;
+	unsigned hits, misses;
+
+	if (sfs_buflock == NULL) {
+		kprintf("sfs buffer cache: not in use\n");
+		return;
+	}
+
+	lock_acquire(sfs_buflock);
+
+	for (i=0; i<SFS_BUF_NHASH; i++) {
+		for (b = sfs_bufhash[i]; b != NULL; b = b->sb_hashnext) {
+			if (b->sb_dirty) {
+				dirty++;
+			}
+			if (b->sb_pincount > 0) {
+				pinned++;
+			}
+		}
+	}
+	hits = sfs_bufhits;
+	misses = sfs_bufmisses;
+
+	kprintf("sfs buffer cache: %u of %u buffers in use, "
+		"%u dirty, %u pinned\n",
+		sfs_bufcount, SFS_BUF_MAX, dirty, pinned);
+	kprintf("    %u hits, %u misses", hits, misses);
+	if (hits + misses > 0) {
+		kprintf(" (%u%% hit rate)", hits * 100 / (hits + misses));
+	}
+	kprintf("\n");
+	kprintf("    %u evictions, %u written back on eviction, "
+		"%u written by sync\n",
+		sfs_bufevictions, sfs_bufwritebacks, sfs_bufsyncwrites);
+	kprintf("    read ahead: %u blocks, %u used (%u still in flight), "
+		"%u unused\n",
+		sfs_bufprefetches, sfs_bufprefetchhits, sfs_bufprefetchwaits,
+		sfs_bufprefetchunused);
+
+	lock_release(sfs_buflock);
+}
@@ -36,9 +36,11 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
+#include <clock.h>
+#include <thread.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -98,6 +100,53 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 			return result;
 		}
 	}
+
+	if (rw == UIO_READ) {
+		/* The bits changed underneath the bitmap's summary */
+		bitmap_recount(sfs->sfs_freemap);
+	}
+	return 0;
+}
+
+/*
+ * Write back everything but the vnodes: dirty buffers, then the free
+ * block map and the superblock.
+ */
+static
+int
+sfs_sync_meta(struct sfs_fs *sfs)
+{
+	int result;
+
+	/* Write back whatever is still dirty in the buffer cache. */
+	result = sfs_buf_sync(sfs);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	/* If the free block map needs to be written, write it. */
+	if (sfs->sfs_freemapdirty) {
+		result = sfs_mapio(sfs, UIO_WRITE);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		sfs->sfs_freemapdirty = false;
+	}
+
+	/* If the superblock needs to be written, write it. */
+	if (sfs->sfs_superdirty) {
+		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		sfs->sfs_superdirty = false;
+	}
+
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -111,11 +160,8 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,35 +194,14 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
-	}
-
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		sfs->sfs_freemapdirty = false;
-	}
-
-	/* If the superblock needs to be written, write it. */
-	if (sfs->sfs_superdirty) {
-		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		sfs->sfs_superdirty = false;
+	/* Get the loaded vnodes' inodes into the buffer cache. */
+	result = sfs_sync_vnodes(sfs);
+	if (result) {
+		return result;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	/* And write everything out. */
+	return sfs_sync_meta(sfs);
 }
 
 /*
@@ -189,13 +214,31 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
+	/* It never changes, so no locking is needed */
+	return sfs->sfs_super.sp_volname;
+}
+
+/*
+ * Write-back. Once an SFS has been mounted, a thread syncs all the
+ * filesystems every SFS_FLUSH_INTERVAL seconds, so delayed file data
+ * and dirty buffers don't sit in memory indefinitely.
+ */
+#define SFS_FLUSH_INTERVAL  5
+
+static bool sfs_flusher_started;
 
-	return ret;
+static
+void
+sfs_flusher(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(SFS_FLUSH_INTERVAL);
+		vfs_sync();
+	}
 }
 
 /*
@@ -208,22 +251,44 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-	
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open, or is a vnode still being
+	 * reclaimed? If so, can't unmount. (Nothing new can be loaded
+	 * after this: that needs a reference to some vnode first, and
+	 * there aren't any, or the root, and vfs_unmount holds
+	 * vfs_biglock, which sfs_getroot's callers need.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_vncount > 0 || sfs->sfs_nreclaiming > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
-	/* We should have just had sfs_sync called. */
+	/*
+	 * We just had sfs_sync called, but a last close may have
+	 * reclaimed a vnode since, dirtying its inode's buffer and the
+	 * free map. Nothing else can touch the filesystem now, so write
+	 * back what's left.
+	 */
+	result = sfs_sync_meta(sfs);
+	if (result) {
+		return result;
+	}
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Reclaiming the vnodes wrote out all the delayed data */
+	KASSERT(sfs->sfs_nreserved == 0);
+
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_buf_dropfs(sfs);
+	sfs_vnhash_cleanup(sfs);
 	bitmap_destroy(sfs->sfs_freemap);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -232,7 +297,6 @@ sfs_unmount(struct fs *fs)
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -257,7 +321,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
+	/* vfs_mount holds vfs_biglock, which serializes mounts */
+	KASSERT(vfs_biglock_do_i_hold());
 
 	/* We don't pass any options through mount */
 	(void)options;
@@ -278,23 +343,39 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		return ENXIO;
 	}
 
+	/* Set up the buffer cache if this is the first mount */
+	result = sfs_buf_init();
+	if (result) {
+		return result;
+	}
+
+	/* Likewise the write-back thread; we can do without it */
+	if (!sfs_flusher_started) {
+		result = thread_fork("sfs flusher", NULL, sfs_flusher,
+				     NULL, 0);
+		if (result) {
+			kprintf("sfs: no flusher thread: %s\n",
+				strerror(result));
+		}
+		else {
+			sfs_flusher_started = true;
+		}
+	}
+
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Allocate vnode table */
+	result = sfs_vnhash_init(sfs);
+	if (result) {
 		kfree(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
+		return result;
 	}
 
 	/* Set the device so we can use sfs_rblock() */
@@ -303,9 +384,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -316,9 +396,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 	
@@ -333,20 +412,35 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
+	/* Create the locks */
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_vnhash_cleanup(sfs);
+		kfree(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_vnhash_cleanup(sfs);
+		kfree(sfs);
+		return ENOMEM;
+	}
+
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
 	sfs->sfs_absfs.fs_getvolname = sfs_getvolname;
@@ -357,11 +451,12 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* the other fields */
 	sfs->sfs_superdirty = false;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_nreserved = 0;
+	sfs->sfs_nreclaiming = 0;
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
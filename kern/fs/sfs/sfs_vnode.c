@@ -37,7 +37,6 @@
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
-#include <array.h>
 #include <bitmap.h>
 #include <uio.h>
 #include <synch.h>
@@ -48,32 +47,54 @@
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
+static void sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv);
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+static int sfs_dblock_flush(struct sfs_vnode *sv);
+
+/* Values for sfs_bmap's DOALLOC */
+#define SFS_BMAP_LOOKUP   0
+#define SFS_BMAP_ALLOC    1
+#define SFS_BMAP_DELAYED  2
 
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
 
-/* Zero out a disk block. */
+/* Zero out a disk block (in the buffer cache). */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct sfs_buf *buf;
+	int result;
+
+	result = sfs_buf_get(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(sfs_buf_data(buf), SFS_BLOCKSIZE);
+	sfs_buf_markdirty(buf);
+	sfs_buf_release(buf);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/* Copy an on-disk inode structure back to its buffer. */
 static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
+		struct sfs_buf *buf;
+		int result = sfs_buf_get(sfs, sv->sv_ino, &buf);
 		if (result) {
 			return result;
 		}
+		memcpy(sfs_buf_data(buf), &sv->sv_i, SFS_BLOCKSIZE);
+		sfs_buf_markdirty(buf);
+		sfs_buf_release(buf);
 		sv->sv_dirty = false;
 	}
 	return 0;
@@ -84,28 +105,98 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Take a free block, the first one at or after HINT (wrapping around
+ * at the end of the disk). Callers pass the block just before where
+ * they'd like it to go, so that files get laid out in order.
+ *
+ * Some free blocks are reserved for delayed data (see sfs_reserve).
+ * If RESERVED, the block is one of those; otherwise they are left
+ * alone. The block's contents are whatever was there before.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc_noclear(struct sfs_fs *sfs, uint32_t hint, bool reserved,
+		   uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	if (reserved) {
+		KASSERT(sfs->sfs_nreserved > 0);
+	}
+	else if (bitmap_nclear(sfs->sfs_freemap) <= sfs->sfs_nreserved) {
+		lock_release(sfs->sfs_freemaplock);
+		return ENOSPC;
+	}
+	result = bitmap_alloc_near(sfs->sfs_freemap, hint, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
+	if (reserved) {
+		sfs->sfs_nreserved--;
+	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
 	}
+	return 0;
+}
+
+/*
+ * Allocate a block, cleared.
+ */
+static
+int
+sfs_balloc(struct sfs_fs *sfs, uint32_t hint, uint32_t *diskblock)
+{
+	int result;
+
+	result = sfs_balloc_noclear(sfs, hint, false, diskblock);
+	if (result) {
+		return result;
+	}
 
 	/* Clear block before returning it */
 	return sfs_clearblock(sfs, *diskblock);
 }
 
+/*
+ * Set aside N free blocks for data whose blocks will be allocated
+ * later, so that writing it out can't run out of space.
+ */
+static
+int
+sfs_reserve(struct sfs_fs *sfs, uint32_t n)
+{
+	int result = 0;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (bitmap_nclear(sfs->sfs_freemap) < sfs->sfs_nreserved + n) {
+		result = ENOSPC;
+	}
+	else {
+		sfs->sfs_nreserved += n;
+	}
+	lock_release(sfs->sfs_freemaplock);
+	return result;
+}
+
+/*
+ * Give back N reserved blocks that turned out not to be needed.
+ */
+static
+void
+sfs_unreserve(struct sfs_fs *sfs, uint32_t n)
+{
+	lock_acquire(sfs->sfs_freemaplock);
+	KASSERT(sfs->sfs_nreserved >= n);
+	sfs->sfs_nreserved -= n;
+	lock_release(sfs->sfs_freemaplock);
+}
+
 /*
  * Free a block.
  */
@@ -113,8 +204,16 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	/*
+	 * Whatever was cached for it no longer needs writing. (Do
+	 * this first, while nobody else can allocate the block.)
+	 */
+	sfs_buf_forget(sfs, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -124,44 +223,65 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * Allocate a data block for sfs_bmap: one of the reserved blocks,
+ * uncleared, for delayed data that is about to be written over it,
+ * otherwise a cleared block.
+ */
+static
+int
+sfs_bmap_balloc(struct sfs_fs *sfs, uint32_t hint, int doalloc,
+		uint32_t *diskblock)
+{
+	if (doalloc == SFS_BMAP_DELAYED) {
+		return sfs_balloc_noclear(sfs, hint, true, diskblock);
+	}
+	return sfs_balloc(sfs, hint, diskblock);
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated, as close after the file's previous block as possible
+ * (or after the inode, for the first block). DOALLOC is one of:
+ *
+ *    SFS_BMAP_LOOKUP   don't allocate; hand back 0 for a hole
+ *    SFS_BMAP_ALLOC    allocate a cleared block
+ *    SFS_BMAP_DELAYED  allocate a reserved block, not cleared, for
+ *                      delayed data (and the reserved indirect
+ *                      block, if one is needed)
  */
 static
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;		/* the indirect block */
+	uint32_t *idptrs;
 	uint32_t block;
 	uint32_t idblock;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,7 +296,13 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			uint32_t prev = sv->sv_ino;
+
+			if (fileblock > 0 &&
+			    sv->sv_i.sfi_direct[fileblock-1] != 0) {
+				prev = sv->sv_i.sfi_direct[fileblock-1];
+			}
+			result = sfs_bmap_balloc(sfs, prev+1, doalloc, &block);
 			if (result) {
 				return result;
 			}
@@ -234,9 +360,26 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * There's no indirect block allocated, but we need to
 		 * allocate a block whose number needs to be stored in
 		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
+		 * indirect block. Put it after the last direct block,
+		 * ahead of the blocks it will point to.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		uint32_t prev = sv->sv_i.sfi_direct[SFS_NDIRECT-1];
+
+		if (prev == 0) {
+			prev = sv->sv_ino;
+		}
+		if (doalloc == SFS_BMAP_DELAYED && sv->sv_idreserved) {
+			result = sfs_balloc_noclear(sfs, prev+1, true,
+						    &idblock);
+			if (result) {
+				return result;
+			}
+			sv->sv_idreserved = false;
+			result = sfs_clearblock(sfs, idblock);
+		}
+		else {
+			result = sfs_balloc(sfs, prev+1, &idblock);
+		}
 		if (result) {
 			return result;
 		}
@@ -246,39 +389,41 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+
+	/*
+	 * Load the indirect block. (If we just allocated it,
+	 * sfs_balloc left it zeroed in the cache.)
+	 */
+	result = sfs_buf_read(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
 	}
+	idptrs = sfs_buf_data(idbuf);
 
 	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	block = idptrs[idoff];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		uint32_t prev = idblock;
+
+		if (idoff > 0 && idptrs[idoff-1] != 0) {
+			prev = idptrs[idoff-1];
+		}
+		result = sfs_bmap_balloc(sfs, prev+1, doalloc, &block);
 		if (result) {
+			sfs_buf_release(idbuf);
 			return result;
 		}
 
 		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		idptrs[idoff] = block;
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+		/* The indirect block is now dirty */
+		sfs_buf_markdirty(idbuf);
 	}
+	sfs_buf_release(idbuf);
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
@@ -289,10 +434,327 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Delayed allocation
+//
+// Data written into a hole of a regular file isn't given a disk block
+// right away. It is kept with the vnode, in sv_delayed, and only
+// allocated and written at flush time: on fsync, sync (including the
+// periodic one from the flusher thread), reclaim, or when too much
+// has piled up. The blocks are then allocated in file order, so
+// they come out contiguous and each run goes to the disk as one
+// request, and nothing needs clearing first: a block only partly
+// written was zero-filled in memory. A free block is reserved for
+// each delayed block (and for the indirect block, if it will be
+// needed) when it's created, so the flush can't run out of space.
+//
+// Delayed data comes first: a block that has some is read and
+// written there even if it's also mapped, which it can be for a
+// while if a flush fails partway.
+//
+// Directories are always allocated straight away.
+
+struct sfs_dblock {
+	uint32_t db_fileblock;		/* block number within the file */
+	bool db_reserved;		/* still holding its reserved block */
+	struct sfs_dblock *db_next;	/* sv_delayed, in file order */
+	char db_data[SFS_BLOCKSIZE];
+};
+
+/* Delayed blocks in memory, over all files, before a writer flushes */
+#define SFS_DELAYED_MAX  256
+
+/* Longest run written in one request by a flush */
+#define SFS_FLUSH_RUN    16
+
+static struct spinlock sfs_delayedlock = SPINLOCK_INITIALIZER;
+static unsigned sfs_ndelayed;
+
+static
+bool
+sfs_delayable(struct sfs_vnode *sv)
+{
+	return sv->sv_i.sfi_type == SFS_TYPE_FILE;
+}
+
+static
+struct sfs_dblock *
+sfs_dblock_find(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_dblock *db;
+
+	for (db = sv->sv_delayed; db != NULL; db = db->db_next) {
+		if (db->db_fileblock >= fileblock) {
+			return db->db_fileblock == fileblock ? db : NULL;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Make a delayed block for FILEBLOCK, which must be a hole. Its data
+ * is zeroed only if ZERO is set.
+ */
+static
+int
+sfs_dblock_create(struct sfs_vnode *sv, uint32_t fileblock, bool zero,
+		  struct sfs_dblock **ret)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dblock *db, **dbp;
+	uint32_t nreserve;
+	bool full;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sfs_dblock_find(sv, fileblock) == NULL);
+
+	/* If memory is getting tied up, write out our own first */
+	spinlock_acquire(&sfs_delayedlock);
+	full = sfs_ndelayed >= SFS_DELAYED_MAX;
+	spinlock_release(&sfs_delayedlock);
+	if (full && sv->sv_delayed != NULL) {
+		result = sfs_dblock_flush(sv);
+		if (result) {
+			return result;
+		}
+	}
+
+	nreserve = 1;
+	if (fileblock >= SFS_NDIRECT && sv->sv_i.sfi_indirect == 0 &&
+	    !sv->sv_idreserved) {
+		nreserve++;
+	}
+	result = sfs_reserve(sfs, nreserve);
+	if (result) {
+		return result;
+	}
+
+	db = kmalloc(sizeof(struct sfs_dblock));
+	if (db == NULL) {
+		sfs_unreserve(sfs, nreserve);
+		return ENOMEM;
+	}
+	if (nreserve > 1) {
+		sv->sv_idreserved = true;
+	}
+	db->db_fileblock = fileblock;
+	db->db_reserved = true;
+	if (zero) {
+		bzero(db->db_data, SFS_BLOCKSIZE);
+	}
+
+	for (dbp = &sv->sv_delayed; *dbp != NULL; dbp = &(*dbp)->db_next) {
+		if ((*dbp)->db_fileblock > fileblock) {
+			break;
+		}
+	}
+	db->db_next = *dbp;
+	*dbp = db;
+
+	spinlock_acquire(&sfs_delayedlock);
+	sfs_ndelayed++;
+	spinlock_release(&sfs_delayedlock);
+
+	*ret = db;
+	return 0;
+}
+
+/*
+ * Unlink and free the delayed block *DBP.
+ */
+static
+void
+sfs_dblock_destroy(struct sfs_vnode *sv, struct sfs_dblock **dbp)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dblock *db = *dbp;
+
+	*dbp = db->db_next;
+	if (db->db_reserved) {
+		sfs_unreserve(sfs, 1);
+	}
+	kfree(db);
+
+	spinlock_acquire(&sfs_delayedlock);
+	KASSERT(sfs_ndelayed > 0);
+	sfs_ndelayed--;
+	spinlock_release(&sfs_delayedlock);
+}
+
+/*
+ * Throw away delayed blocks from file block BLOCKLEN on, for
+ * truncate, along with the indirect block's reservation if nothing
+ * is left that would need it.
+ */
+static
+void
+sfs_dblock_truncate(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dblock **dbp;
+	bool needid = false;
+
+	dbp = &sv->sv_delayed;
+	while (*dbp != NULL) {
+		if ((*dbp)->db_fileblock >= blocklen) {
+			sfs_dblock_destroy(sv, dbp);
+			continue;
+		}
+		if ((*dbp)->db_fileblock >= SFS_NDIRECT) {
+			needid = true;
+		}
+		dbp = &(*dbp)->db_next;
+	}
+
+	if (sv->sv_idreserved && !needid) {
+		sfs_unreserve(sfs, 1);
+		sv->sv_idreserved = false;
+	}
+}
+
+/*
+ * Find or allocate the disk block for the delayed block DB.
+ */
+static
+int
+sfs_dblock_map(struct sfs_vnode *sv, struct sfs_dblock *db,
+	       uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	int result;
+
+	result = sfs_bmap(sv, db->db_fileblock, SFS_BMAP_LOOKUP, diskblock);
+	if (result) {
+		return result;
+	}
+	if (*diskblock != 0) {
+		/* Mapped by an earlier, failed flush */
+		if (db->db_reserved) {
+			sfs_unreserve(sfs, 1);
+			db->db_reserved = false;
+		}
+		return 0;
+	}
+
+	KASSERT(db->db_reserved);
+	result = sfs_bmap(sv, db->db_fileblock, SFS_BMAP_DELAYED, diskblock);
+	if (result) {
+		return result;
+	}
+	db->db_reserved = false;
+	return 0;
+}
+
+/*
+ * Give all of SV's delayed blocks disk blocks and write them out.
+ * Runs of consecutive file blocks that get consecutive disk blocks
+ * are copied together into a staging buffer and written with one
+ * request. (If the staging buffer can't be had, the blocks go one
+ * at a time, straight from where they are.)
+ */
+static
+int
+sfs_dblock_flush(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dblock *db, *next;
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	uint32_t first, block, n, max, i;
+	int result = 0;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_delayed == NULL) {
+		return 0;
+	}
+
+	buf = kmalloc(SFS_FLUSH_RUN * SFS_BLOCKSIZE);
+	max = buf != NULL ? SFS_FLUSH_RUN : 1;
+
+	while ((db = sv->sv_delayed) != NULL) {
+		result = sfs_dblock_map(sv, db, &first);
+		if (result) {
+			break;
+		}
+		n = 1;
+		for (next = db->db_next; next != NULL && n < max;
+		     next = next->db_next) {
+			if (next->db_fileblock != db->db_fileblock + n) {
+				break;
+			}
+			result = sfs_dblock_map(sv, next, &block);
+			if (result) {
+				break;
+			}
+			if (block != first + n) {
+				break;
+			}
+			n++;
+		}
+		if (result) {
+			break;
+		}
+
+		/*
+		 * Nothing should be cached for these blocks, but a
+		 * read-ahead could have picked one up after a failed
+		 * flush; it would be stale once this is written.
+		 */
+		for (i=0; i<n; i++) {
+			sfs_buf_forget(sfs, first + i);
+		}
+
+		if (n == 1) {
+			result = sfs_wblock(sfs, db->db_data, first);
+		}
+		else {
+			next = db;
+			for (i=0; i<n; i++) {
+				memcpy(buf + i*SFS_BLOCKSIZE, next->db_data,
+				       SFS_BLOCKSIZE);
+				next = next->db_next;
+			}
+			uio_kinit(&iov, &ku, buf, n * SFS_BLOCKSIZE,
+				  (off_t)first * SFS_BLOCKSIZE, UIO_WRITE);
+			result = sfs_rwblock(sfs, &ku);
+		}
+		if (result) {
+			break;
+		}
+
+		for (i=0; i<n; i++) {
+			sfs_dblock_destroy(sv, &sv->sv_delayed);
+		}
+	}
+
+	if (buf != NULL) {
+		kfree(buf);
+	}
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
+/*
+ * How sfs_bmap should treat holes for I/O in UIO: allocate them only
+ * if writing, and then only in directories; files get delayed blocks.
+ */
+static
+int
+sfs_iodoalloc(struct sfs_vnode *sv, struct uio *uio)
+{
+	if (uio->uio_rw == UIO_WRITE && !sfs_delayable(sv)) {
+		return SFS_BMAP_ALLOC;
+	}
+	return SFS_BMAP_LOOKUP;
+}
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
@@ -308,71 +770,73 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
+	struct sfs_dblock *db;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	
-	/* Allocate missing blocks if and only if we're writing */
-	int doalloc = (uio->uio_rw==UIO_WRITE);
+	int doalloc = sfs_iodoalloc(sv, uio);
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
-	if (result) {
-		return result;
+	/* Delayed data, if there is any, is the latest */
+	db = sfs_dblock_find(sv, fileblock);
+	if (db == NULL) {
+		/* Get the disk block number */
+		result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+		if (result) {
+			return result;
+		}
+
+		/* Writing a hole in a file makes a new delayed block */
+		if (diskblock == 0 && uio->uio_rw == UIO_WRITE) {
+			result = sfs_dblock_create(sv, fileblock, true, &db);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	if (db != NULL) {
+		return uiomove(db->db_data + skipstart, len, uio);
 	}
 
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Hand back zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_buf_read(sfs, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove((char *)sfs_buf_data(iobuf)+skipstart, len, uio);
+
+	/*
+	 * If it was a write, the block is now dirty. (Even if uiomove
+	 * failed partway; some of it may have been changed.)
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		sfs_buf_markdirty(iobuf);
 	}
+	sfs_buf_release(iobuf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -383,60 +847,296 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
+	struct sfs_dblock *db;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	int doalloc = sfs_iodoalloc(sv, uio);
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
+	/* Delayed data, if there is any, is the latest */
+	db = sfs_dblock_find(sv, fileblock);
+	if (db != NULL) {
+		return uiomove(db->db_data, SFS_BLOCKSIZE, uio);
+	}
+
 	/* Look up the disk block number */
 	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
 	if (result) {
 		return result;
 	}
 
-	if (diskblock == 0) {
-		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+	if (diskblock == 0 && uio->uio_rw == UIO_WRITE) {
+		/*
+		 * A hole in a file: make a delayed block. It's all
+		 * being written, so needn't be zeroed first - unless
+		 * the copy fails, when it mustn't keep what kmalloc
+		 * left in it.
+		 */
+		result = sfs_dblock_create(sv, fileblock, false, &db);
+		if (result) {
+			return result;
+		}
+		result = uiomove(db->db_data, SFS_BLOCKSIZE, uio);
+		if (result) {
+			bzero(db->db_data, SFS_BLOCKSIZE);
+		}
+		return result;
+	}
+
+	if (diskblock == 0) {
+		/*
+		 * No block - fill with zeros.
+		 *
+		 * We must be reading, or we'd have a block or a
+		 * delayed block by now.
+		 */
+		KASSERT(uio->uio_rw == UIO_READ);
+		return uiomovezeros(SFS_BLOCKSIZE, uio);
+	}
+
+	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
+
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_buf_read(sfs, diskblock, &iobuf);
+		if (result) {
+			return result;
+		}
+		result = uiomove(sfs_buf_data(iobuf), SFS_BLOCKSIZE, uio);
+		sfs_buf_release(iobuf);
+		return result;
+	}
+
+	/*
+	 * Writing the whole block, so there's no need to read it
+	 * first. If the copy fails partway through a block we didn't
+	 * have cached, the buffer holds garbage; leave it invalid so
+	 * it gets dropped rather than written.
+	 */
+	result = sfs_buf_get(sfs, diskblock, &iobuf);
+	if (result) {
+		return result;
+	}
+	result = uiomove(sfs_buf_data(iobuf), SFS_BLOCKSIZE, uio);
+	if (result == 0 || sfs_buf_valid(iobuf)) {
+		sfs_buf_markdirty(iobuf);
+	}
+	sfs_buf_release(iobuf);
+	return result;
+}
+
+/*
+ * Read-ahead.
+ *
+ * A read that starts where the last one on the vnode ended is taken
+ * as sequential, and each one in a row doubles the window (from
+ * SFS_RA_MIN up to SFS_RA_MAX blocks); anything else closes it again.
+ * Before a read is done, prefetches are started for the window after
+ * it, so the disk is already working on the next read's blocks. The
+ * read's own whole blocks are read directly, in runs (see
+ * sfs_extentio), so aren't prefetched. sv_ranext remembers how far
+ * we've got so blocks aren't asked for twice.
+ */
+#define SFS_RA_MIN  4
+#define SFS_RA_MAX  16
+
+/*
+ * Start prefetches for file blocks FROM up to (not including) TO.
+ * Nothing here may wait for the disk, so if the indirect block is
+ * needed and isn't cached, prefetch it and stop there; the next
+ * call picks up from that point. Returns the first block not dealt
+ * with.
+ */
+static
+uint32_t
+sfs_readahead(struct sfs_vnode *sv, uint32_t from, uint32_t to)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *idptrs = NULL;
+	uint32_t fileblock, block, idblock;
+	uint32_t eof = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	int result;
+
+	if (to > eof) {
+		to = eof;
+	}
+	if (to > SFS_NDIRECT + SFS_DBPERIDB) {
+		to = SFS_NDIRECT + SFS_DBPERIDB;
+	}
+
+	idbuf = NULL;
+	for (fileblock = from; fileblock < to; fileblock++) {
+		if (fileblock < SFS_NDIRECT) {
+			block = sv->sv_i.sfi_direct[fileblock];
+		}
+		else {
+			if (idbuf == NULL) {
+				idblock = sv->sv_i.sfi_indirect;
+				if (idblock == 0) {
+					/* All holes from here on */
+					fileblock = to;
+					break;
+				}
+				if (!sfs_buf_iscached(sfs, idblock)) {
+					sfs_buf_prefetch(sfs, idblock);
+					break;
+				}
+				result = sfs_buf_read(sfs, idblock, &idbuf);
+				if (result) {
+					break;
+				}
+				idptrs = sfs_buf_data(idbuf);
+			}
+			block = idptrs[fileblock - SFS_NDIRECT];
+		}
+
+		/* Holes don't need reading */
+		if (block != 0) {
+			sfs_buf_prefetch(sfs, block);
+		}
+	}
+
+	if (idbuf != NULL) {
+		sfs_buf_release(idbuf);
+	}
+	return fileblock;
+}
+
+/*
+ * Update the sequential-access state for a read of RESID bytes at
+ * OFFSET, and start whatever prefetches that calls for.
+ */
+static
+void
+sfs_readahead_start(struct sfs_vnode *sv, off_t offset, size_t resid)
+{
+	uint32_t last, from;
+
+	KASSERT(resid > 0);
+
+	last = (offset + resid - 1) / SFS_BLOCKSIZE;
+
+	if (offset == sv->sv_raoffset) {
+		sv->sv_rawindow = sv->sv_rawindow == 0 ? SFS_RA_MIN :
+			sv->sv_rawindow * 2;
+		if (sv->sv_rawindow > SFS_RA_MAX) {
+			sv->sv_rawindow = SFS_RA_MAX;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_ranext = 0;
+	}
+	sv->sv_raoffset = offset + resid;
+
+	from = last + 1;
+	if (from < sv->sv_ranext) {
+		from = sv->sv_ranext;
+	}
+	if (from <= last + sv->sv_rawindow) {
+		sv->sv_ranext = sfs_readahead(sv, from,
+					      last + sv->sv_rawindow + 1);
+	}
+}
+
+/*
+ * Do I/O of up to MAXBLOCKS whole blocks, starting at a block
+ * boundary, and say how many were done in DONE.
+ *
+ * File blocks that sit in consecutive disk blocks are moved between
+ * the device and the caller's uio in a single request, bypassing the
+ * buffer cache. A read stops short of any block the cache has, since
+ * the cached copy may be newer than the disk; a write discards cached
+ * copies of the blocks it covers, since they are about to be entirely
+ * overwritten. (Blocks freshly allocated by sfs_bmap are cached as
+ * zeros, so those are never written twice.) Holes, delayed blocks, a
+ * first block a read finds cached, and runs of one block go to
+ * sfs_blockio, so small I/O still gets the cache.
+ */
+#define SFS_EXTENT_MAX  64
+
+static
+int
+sfs_extentio(struct sfs_vnode *sv, struct uio *uio, uint32_t maxblocks,
+	     uint32_t *done)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	int doalloc = sfs_iodoalloc(sv, uio);
+	bool writing = (uio->uio_rw==UIO_WRITE);
+	uint32_t fileblock, first, block, n, i;
+	off_t fileoffset;
+	size_t resid, len;
+	int result;
+
+	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
+	KASSERT(maxblocks > 0 && uio->uio_resid >= maxblocks * SFS_BLOCKSIZE);
+
+	if (maxblocks > SFS_EXTENT_MAX) {
+		maxblocks = SFS_EXTENT_MAX;
+	}
+
+	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	if (sfs_dblock_find(sv, fileblock) != NULL) {
+		*done = 1;
+		return sfs_blockio(sv, uio);
+	}
+	result = sfs_bmap(sv, fileblock, doalloc, &first);
+	if (result) {
+		return result;
+	}
+	if (first == 0 || (!writing && sfs_buf_present(sfs, first))) {
+		*done = 1;
+		return sfs_blockio(sv, uio);
+	}
+
+	/* See how far the run goes */
+	for (n = 1; n < maxblocks; n++) {
+		if (sfs_dblock_find(sv, fileblock + n) != NULL) {
+			break;
+		}
+		result = sfs_bmap(sv, fileblock + n, doalloc, &block);
+		if (result) {
+			return result;
+		}
+		if (block != first + n) {
+			break;
+		}
+		if (!writing && sfs_buf_present(sfs, block)) {
+			break;
+		}
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (n == 1) {
+		*done = 1;
+		return sfs_blockio(sv, uio);
+	}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	if (writing) {
+		for (i = 0; i < n; i++) {
+			sfs_buf_forget(sfs, first + i);
+		}
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
+	 * Point the uio at the disk for the transfer, then back at
+	 * the file.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	fileoffset = uio->uio_offset;
+	resid = uio->uio_resid;
+	len = n * SFS_BLOCKSIZE;
+
+	uio->uio_offset = (off_t)first * SFS_BLOCKSIZE;
+	uio->uio_resid = len;
+	result = sfs_rwblock(sfs, uio);
+	len -= uio->uio_resid;
+	uio->uio_offset = fileoffset + len;
+	uio->uio_resid = resid - len;
 
+	*done = n;
 	return result;
 }
 
@@ -448,7 +1148,7 @@ int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks, done;
 	int result = 0;
 	uint32_t extraresid = 0;
 
@@ -471,6 +1171,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		if (uio->uio_resid > 0) {
+			sfs_readahead_start(sv, uio->uio_offset,
+					    uio->uio_resid);
+		}
 	}
 
 	/*
@@ -502,15 +1207,17 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Now we should be block-aligned. Do the remaining whole blocks.
+	 * Now we should be block-aligned. Do the remaining whole
+	 * blocks, as many at a time as lie together on disk.
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	while (nblocks > 0) {
+		result = sfs_extentio(sv, uio, nblocks, &done);
 		if (result) {
 			goto out;
 		}
+		nblocks -= done;
 	}
 
 	/*
@@ -787,11 +1494,13 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 // Object creation
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object and hand back its vnode. The inode
+ * goes near the directory DIR it is being created in.
  */
 static
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, struct sfs_vnode *dir, int type,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
@@ -801,7 +1510,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, dir->sv_ino+1, &ino);
 	if (result) {
 		return result;
 	}
@@ -875,8 +1584,18 @@ static
 int
 sfs_close(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	/*
+	 * Put the inode in the buffer cache. It and the file's data
+	 * reach the disk on the next sync, or when evicted.
+	 */
+	lock_acquire(sv->sv_lock);
+	result = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+
+	return result;
 }
 
 /*
@@ -890,75 +1609,162 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
-	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * Holding the vnode lock, nobody who picks the vnode up
+	 * meanwhile can change it behind our back.
 	 */
-	if (v->vn_refcount != 1) {
-
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
-
-		vfs_biglock_release();
-		return EBUSY;
-	}
+	lock_acquire(sv->sv_lock);
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_dotruncate(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 	}
 
-	/* Sync the inode to disk */
+	/* Write out delayed data, and sync the inode to the buffer cache */
+	result = sfs_dblock_flush(sv);
+	if (result) {
+		lock_release(sv->sv_lock);
+		return result;
+	}
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
-	}
+	/*
+	 * Make sure someone else hasn't picked up the vnode since the
+	 * decision was made to reclaim it. sfs_loadvnode finds vnodes
+	 * under sfs_vnlock, and the name cache under its own lock, so
+	 * purge the latter first and check the count after.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	vfs_ncache_purgevn(&sv->sv_v);
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount>1);
+		v->vn_refcount--;
+
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		return EBUSY;
 	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
+	spinlock_release(&v->vn_countlock);
+
+	/*
+	 * Remove the vnode structure from the table in the struct
+	 * sfs_fs. Count it as still being reclaimed until it's all
+	 * gone, so sfs_unmount doesn't free the filesystem under us.
+	 */
+	sfs_vnhash_remove(sfs, sv);
+	sfs->sfs_nreclaiming++;
+
+	lock_release(sfs->sfs_vnlock);
+	lock_release(sv->sv_lock);
+
+	/*
+	 * If there are no on-disk references, discard the inode. Not
+	 * before it's out of the table, or the block could be reused
+	 * for a new inode while the old vnode could still be found.
+	 */
+	if (sv->sv_i.sfi_linkcount==0) {
+		sfs_bfree(sfs, sv->sv_ino);
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
 
 	VOP_CLEANUP(&sv->sv_v);
-
-	vfs_biglock_release();
+	lock_destroy(sv->sv_lock);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
 
-	/* Done */
+	/* Done; this is our last look at the filesystem */
+	lock_acquire(sfs->sfs_vnlock);
+	KASSERT(sfs->sfs_nreclaiming > 0);
+	sfs->sfs_nreclaiming--;
+	lock_release(sfs->sfs_vnlock);
 	return 0;
 }
 
+/*
+ * Do I/O between the file and user memory.
+ *
+ * Touching user memory can fault, and the fault can read the page in
+ * from the program's executable: possibly this very file, or one
+ * whose lock another thread holds while it faults on ours. So user
+ * memory is never touched with sv_lock held. The data is staged
+ * through a kernel buffer instead, SFS_USERIO_CHUNK bytes at a time,
+ * with the lock held only while moving each chunk between the buffer
+ * and the file. The chunks after the first are block-aligned.
+ */
+#define SFS_USERIO_CHUNK  (16 * SFS_BLOCKSIZE)
+
+static
+int
+sfs_userio(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	size_t len, done;
+	off_t pos;
+	int result = 0;
+
+	buf = kmalloc(SFS_USERIO_CHUNK);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	while (uio->uio_resid > 0) {
+		pos = uio->uio_offset;
+		len = SFS_USERIO_CHUNK - pos % SFS_BLOCKSIZE;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		if (uio->uio_rw == UIO_READ) {
+			uio_kinit(&iov, &ku, buf, len, pos, UIO_READ);
+			lock_acquire(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			lock_release(sv->sv_lock);
+			if (result) {
+				break;
+			}
+			done = len - ku.uio_resid;
+			result = uiomove(buf, done, uio);
+			if (result || done < len) {
+				/* fault, or EOF */
+				break;
+			}
+		}
+		else {
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
+			uio_kinit(&iov, &ku, buf, len, pos, UIO_WRITE);
+			lock_acquire(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			lock_release(sv->sv_lock);
+			if (result) {
+				break;
+			}
+		}
+	}
+
+	kfree(buf);
+	return result;
+}
+
 /*
  * Called for read(). sfs_io() does the work.
  */
@@ -971,9 +1777,13 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return sfs_userio(sv, uio);
+	}
+
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -990,9 +1800,13 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return sfs_userio(sv, uio);
+	}
+
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -1033,7 +1847,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +1869,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes, so no locking is needed */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1102,9 +1915,16 @@ sfs_fsync(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
-	vfs_biglock_acquire();
-	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_acquire(sv->sv_lock);
+	result = sfs_dblock_flush(sv);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	lock_release(sv->sv_lock);
+	if (result == 0) {
+		/* Get the inode and anything else dirty out to disk */
+		result = sfs_buf_sync(sv->sv_v.vn_fs->fs_data);
+	}
 
 	return result;
 }
@@ -1121,35 +1941,46 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Called for ftruncate().
  */
 static
 int
 sfs_truncate(struct vnode *v, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	lock_release(sv->sv_lock);
+
+	return result;
+}
+
+/*
+ * Truncate, with the vnode locked. Also used by sfs_reclaim.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
+	struct sfs_buf *idbuf;		/* the indirect block */
+	uint32_t *idptrs;
 	uint32_t i, j, block;
 	uint32_t idblock, baseblock, highblock;
 	int result;
 	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	/* Delayed data past the end just goes away */
+	sfs_dblock_truncate(sv, blocklen);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1177,41 +2008,38 @@ sfs_truncate(struct vnode *v, off_t len)
 		/* We're past the proposed EOF; may need to free stuff */
 
 		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
+		result = sfs_buf_read(sfs, idblock, &idbuf);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
+		idptrs = sfs_buf_data(idbuf);
 		
 		hasnonzero = 0;
 		iddirty = 0;
 		for (j=0; j<SFS_DBPERIDB; j++) {
 			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
+			if (blocklen < baseblock+j && idptrs[j] != 0) {
+				sfs_bfree(sfs, idptrs[j]);
+				idptrs[j] = 0;
 				iddirty = 1;
 			}
 			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
+			if (idptrs[j]!=0) {
 				hasnonzero=1;
 			}
 		}
 
+		if (iddirty) {
+			sfs_buf_markdirty(idbuf);
+		}
+		sfs_buf_release(idbuf);
+
 		if (!hasnonzero) {
 			/* The whole indirect block is empty now; free it */
 			sfs_bfree(sfs, idblock);
 			sv->sv_i.sfi_indirect = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
 	}
 
 	/* Set the file size */
@@ -1220,7 +2048,6 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1259,18 +2086,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -1278,18 +2105,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, sv, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1300,19 +2127,24 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
+
+	/* The name may be cached as not existing */
+	vfs_ncache_enter(v, name, &newguy->sv_v);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1331,20 +2163,29 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/* Linking the directory into itself would take its lock twice */
+	if (f == sv) {
+		return EINVAL;
+	}
+
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	lock_release(f->sv_lock);
+
+	vfs_ncache_enter(dir, name, file);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,12 +2201,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1373,15 +2214,18 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
+		vfs_ncache_remove(dir, name);
 	}
 
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -1401,21 +2245,24 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* We don't support subdirectories */
 	KASSERT(g1->sv_i.sfi_type == SFS_TYPE_FILE);
 
+	/* The file's lock comes after the directory's */
+	lock_acquire(g1->sv_lock);
+
 	/*
 	 * Link it under the new name.
 	 *
@@ -1447,10 +2294,14 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
 
+	vfs_ncache_remove(d1, n1);
+	vfs_ncache_enter(d1, n2, &g1->sv_v);
+
 	/* Let go of the reference to g1 */
+	lock_release(g1->sv_lock);
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 
  puke_harder:
@@ -1467,8 +2318,9 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_i.sfi_linkcount--;
  puke:
 	/* Let go of the reference to g1 */
+	lock_release(g1->sv_lock);
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -1486,15 +2338,13 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
+	/* Nothing here that needs the vnode locked */
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2352,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +2369,31 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
+
+	lock_acquire(sv->sv_lock);
+
+	/* Try the name cache before scanning the directory */
+	if (vfs_ncache_lookup(v, path, ret)) {
+		lock_release(sv->sv_lock);
+		return *ret != NULL ? 0 : ENOENT;
+	}
 	
 	result = sfs_lookonce(sv, path, &final, NULL);
+	if (result == ENOENT) {
+		vfs_ncache_enter(v, path, NULL);
+	}
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
+	vfs_ncache_enter(v, path, &final->sv_v);
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1642,6 +2500,187 @@ static const struct vnode_ops sfs_dirops = {
 	sfs_lookparent,
 };
 
+/*
+ * Table of loaded vnodes, hashed by inode number. Each bucket is a
+ * chain through sv_hashnext. The table doubles whenever there are
+ * more than SFS_VNHASH_LOAD vnodes per bucket on average; if the
+ * memory for that can't be had, the chains just get longer. It is
+ * protected by sfs_vnlock.
+ */
+#define SFS_VNHASH_INITSIZE  32		/* a power of two */
+#define SFS_VNHASH_LOAD      2
+
+static
+unsigned
+sfs_vnhash_bucket(unsigned size, uint32_t ino)
+{
+	/* Inodes are spread over the disk; the low bits will do */
+	return ino & (size - 1);
+}
+
+int
+sfs_vnhash_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_INITSIZE *
+				  sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_VNHASH_INITSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_vnhashsize = SFS_VNHASH_INITSIZE;
+	sfs->sfs_vncount = 0;
+	return 0;
+}
+
+void
+sfs_vnhash_cleanup(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_vncount == 0);
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = NULL;
+}
+
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sv = sfs->sfs_vnhash[sfs_vnhash_bucket(sfs->sfs_vnhashsize, ino)];
+	while (sv != NULL && sv->sv_ino != ino) {
+		sv = sv->sv_hashnext;
+	}
+	return sv;
+}
+
+/* Double the number of buckets, if we can. */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **newhash, *sv, *next;
+	unsigned newsize, i, b;
+
+	newsize = sfs->sfs_vnhashsize * 2;
+	newhash = kmalloc(newsize * sizeof(struct sfs_vnode *));
+	if (newhash == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newhash[i] = NULL;
+	}
+
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = next) {
+			next = sv->sv_hashnext;
+			b = sfs_vnhash_bucket(newsize, sv->sv_ino);
+			sv->sv_hashnext = newhash[b];
+			newhash[b] = sv;
+		}
+	}
+
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = newhash;
+	sfs->sfs_vnhashsize = newsize;
+}
+
+static
+void
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned b;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	if (sfs->sfs_vncount >= sfs->sfs_vnhashsize * SFS_VNHASH_LOAD) {
+		sfs_vnhash_grow(sfs);
+	}
+
+	b = sfs_vnhash_bucket(sfs->sfs_vnhashsize, sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[b];
+	sfs->sfs_vnhash[b] = sv;
+	sfs->sfs_vncount++;
+}
+
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **p;
+	unsigned b;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	b = sfs_vnhash_bucket(sfs->sfs_vnhashsize, sv->sv_ino);
+	for (p = &sfs->sfs_vnhash[b]; *p != sv; p = &(*p)->sv_hashnext) {
+		if (*p == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
+		}
+	}
+	*p = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	KASSERT(sfs->sfs_vncount > 0);
+	sfs->sfs_vncount--;
+}
+
+/*
+ * Write out every loaded vnode's delayed data and get its inode into
+ * the buffer cache, for sync.
+ * The vnode locks come before sfs_vnlock, so take a reference to each
+ * vnode under the latter and do the syncing after letting go of it.
+ */
+int
+sfs_sync_vnodes(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv, **svs;
+	unsigned i, n;
+	int result, ret = 0;
+
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_vncount == 0) {
+		lock_release(sfs->sfs_vnlock);
+		return 0;
+	}
+	svs = kmalloc(sfs->sfs_vncount * sizeof(struct sfs_vnode *));
+	if (svs == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	n = 0;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = sv->sv_hashnext) {
+			VOP_INCREF(&sv->sv_v);
+			svs[n++] = sv;
+		}
+	}
+	KASSERT(n == sfs->sfs_vncount);
+	lock_release(sfs->sfs_vnlock);
+
+	for (i=0; i<n; i++) {
+		sv = svs[i];
+		lock_acquire(sv->sv_lock);
+		result = sfs_dblock_flush(sv);
+		if (result == 0) {
+			result = sfs_sync_inode(sv);
+		}
+		lock_release(sv->sv_lock);
+		if (result && ret == 0) {
+			ret = result;
+		}
+		VOP_DECREF(&sv->sv_v);
+	}
+
+	kfree(svs);
+	return ret;
+}
+
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
@@ -1651,42 +2690,36 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
+	struct sfs_buf *buf;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_v);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1697,15 +2730,34 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_rblock(sfs, &sv->sv_i, ino);
+	result = sfs_buf_read(sfs, ino, &buf);
 	if (result) {
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
+	memcpy(&sv->sv_i, sfs_buf_data(buf), sizeof(sv->sv_i));
+	sfs_buf_release(buf);
+
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No reads yet */
+	sv->sv_raoffset = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_ranext = 0;
+
+	/* No delayed writes yet */
+	sv->sv_delayed = NULL;
+	sv->sv_idreserved = false;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out and thus the type
@@ -1736,7 +2788,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -1744,12 +2798,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	sfs_vnhash_add(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1767,14 +2818,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
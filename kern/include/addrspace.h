@@ -38,6 +38,9 @@
 #include <vm.h>
 #include "opt-A2.h"
 #include "opt-A3.h"
+#if OPT_A3
+#include <spinlock.h>
+#endif
 
 struct vnode;
 
@@ -52,16 +55,65 @@ struct vnode;
 #if OPT_A3
 struct pt_entry{
         paddr_t frame;
-        bool isValid;
+        unsigned isValid:1;
+        unsigned isCopyOnWrite:1; /* frame shared since fork; copy before writing */
+        unsigned isSwapped:1;   /* not resident; contents are in swapSlot */
+        unsigned isBusy:1;      /* on its way out to swap; wait for it */
+        unsigned swapSlot:28;
+};
+
+/*
+ * Page tables have two levels, indexed by virtual page number. The top
+ * bits pick one of PT_L1_SIZE second-level tables, each exactly one
+ * page of PT_L2_SIZE entries, which only exists once some page it
+ * covers has been touched.
+ */
+#define PT_L2_SIZE      (PAGE_SIZE / sizeof(struct pt_entry))
+#define PT_L1_SIZE      (USERSPACETOP / PAGE_SIZE / PT_L2_SIZE)
+
+/*
+ * Software TLB: the last few pages vm_fault resolved, so a refill for
+ * a page that was only knocked out of the real TLB skips the region
+ * checks and the page table walk. Direct-mapped on the page number;
+ * only the owning process uses it.
+ */
+#define SWTLB_SIZE      64
+
+/* vaddr of an empty slot; not page-aligned, so no fault can match it */
+#define SWTLB_EMPTY     ((vaddr_t)-1)
+
+struct swtlb_entry{
+        vaddr_t vaddr;          /* page, or SWTLB_EMPTY */
+        struct pt_entry *pte;   /* stays put until as_destroy */
+        bool isCode;
+};
+
+/*
+ * Where the file-backed part of an ELF segment lives in the
+ * executable. Pages of the segment are read in from here the first
+ * time they are touched; anything past filesize is zero-filled.
+ */
+struct elf_backing{
+        vaddr_t vaddr;          /* unaligned start of the segment */
+        off_t offset;           /* file offset of the segment */
+        size_t filesize;        /* bytes of the segment stored in the file */
 };
 #endif
 
 struct addrspace {
 #if OPT_A3
-  struct pt_entry *as_pt1;
-  struct pt_entry *as_pt2;
-  struct pt_entry *as_stackpt;
+  struct pt_entry **as_pt;      /* PT_L1_SIZE second-level tables, or NULL */
+  vaddr_t as_stackbase;         /* lowest stack page so far; grows down on faults */
+  vaddr_t as_heapbase;          /* heap starts right above the data segment */
+  vaddr_t as_heaptop;           /* current break, moved by sbrk */
+  struct swtlb_entry as_swtlb[SWTLB_SIZE];
+  unsigned as_asid;             /* TLB address space ID */
+  unsigned as_asidgen;          /* ASID generation as_asid is from; 0 if none */
   bool isLoadComplete;
+  struct vnode *as_vnode;       /* executable; NULL until load_elf runs */
+  struct elf_backing as_elf1;
+  struct elf_backing as_elf2;
+  struct spinlock as_lock;      /* pte residency, against page-out */
 #else
   paddr_t as_pbase1;
   paddr_t as_pbase2;
@@ -110,6 +162,13 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_backing - record where in the executable V the region
+ *                starting at VADDR comes from, so its pages can be
+ *                read in on demand by vm_fault instead of up front.
+ *
+ *    as_sbrk   - move the top of the heap by AMOUNT bytes, handing back
+ *                the old top. Pages above a lowered break are freed.
  */
 
 struct addrspace *as_create(void);
@@ -129,6 +188,13 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 #if OPT_A2
 int               as_define_args(struct addrspace *as, char **args, int argc, vaddr_t *stackptr);
 #endif
+#if OPT_A3
+int               as_define_backing(struct addrspace *as, struct vnode *v,
+                                    off_t offset, vaddr_t vaddr,
+                                    size_t filesize);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldtop);
+#endif
 
 /*
  * Functions in loadelf.c
@@ -38,9 +38,14 @@
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_alloc_near - same, but take the first cleared bit at or
+ *                      after a hint, wrapping around at the end.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
+ *     bitmap_nclear  - return how many bits are clear.
+ *     bitmap_recount - resynchronize after changing the raw bit data
+ *                      obtained from bitmap_getdata (e.g. reading it in).
  *     bitmap_destroy - destroy bitmap.
  */
 
@@ -50,9 +55,13 @@ struct bitmap;  /* Opaque. */
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_near(struct bitmap *, unsigned hint,
+                                 unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
 int            bitmap_isset(struct bitmap *, unsigned index);
+unsigned       bitmap_nclear(struct bitmap *);
+void           bitmap_recount(struct bitmap *);
 void           bitmap_destroy(struct bitmap *);
 
 
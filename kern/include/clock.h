@@ -56,6 +56,13 @@
 #define HZ  100
 #endif
 
+/*
+ * Timing constants. These should be tuned along with any work done on
+ * the scheduler. A thread that runs for SCHEDULE_HARDCLOCKS without
+ * blocking has used up its quantum.
+ */
+#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
+
 void hardclock_bootstrap(void);
 
 void hardclock(void);
@@ -35,6 +35,12 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+/* Number of free pages each cpu may keep cached (see struct cpu) */
+#define CPU_PAGECACHE_MAX  16
+
+/* Number of scheduling priority levels, each with its own run queue */
+#define CPU_NPRIO  4
+
 
 /*
  * Per-cpu structure
@@ -57,16 +63,27 @@ struct cpu {
 	/*
 	 * Accessed only by this cpu.
 	 */
-	struct thread *c_curthread;	/* Current thread on cpu */
+	struct thread *c_curthread;	/* Current thread on cpu (others may
+					   read it holding the runqueue lock) */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_asid;		/* Address space ID now in the MMU */
+	unsigned c_asidgen;		/* ASID generation the TLB holds */
+	unsigned c_runticks[CPU_NPRIO];	/* Hardclocks spent running, by level */
+	unsigned c_demotions;		/* Threads that used up a quantum */
+	unsigned c_boosts;		/* Anti-starvation boosts done */
+	uint32_t c_stealrand;		/* Random state for picking victims */
+	unsigned c_steals;		/* Threads taken from other cpus */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[CPU_NPRIO]; /* Run queues, by priority */
+	unsigned c_runcount;		/* Threads on all of them */
+	unsigned c_dispatches[CPU_NPRIO]; /* Threads picked to run, by level */
+	unsigned c_waitticks[CPU_NPRIO]; /* Hardclocks they had been waiting */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -87,6 +104,19 @@ struct cpu {
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
 	struct spinlock c_ipi_lock;
+
+	/*
+	 * Cache of free physical pages owned by the VM system, so
+	 * that single-page allocations don't all go through the
+	 * global page allocator. Normally used only by this cpu, but
+	 * protected by its own lock so that others can drain it when
+	 * memory runs short.
+	 */
+	paddr_t c_pagecache[CPU_PAGECACHE_MAX];
+	unsigned c_pagecache_count;
+	unsigned c_pagecache_hits;	/* allocations served from the cache */
+	unsigned c_pagecache_misses;	/* allocations that had to refill it */
+	struct spinlock c_pagecache_lock;
 };
 
 #define TLBSHOOTDOWN_ALL  (-1)
@@ -106,6 +136,13 @@ struct cpu {
  */
 struct cpu *cpu_create(unsigned hardware_number);
 void cpu_machdep_init(struct cpu *);
+
+/*
+ * cpu_count returns the number of cpus; cpu_get returns the cpu with
+ * software number NUM (0 <= NUM < cpu_count()).
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned num);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
@@ -122,6 +159,13 @@ const char *cpu_identify(void);
 void cpu_irqoff(void);
 void cpu_irqon(void);
 
+/*
+ * Read the current CPU's free-running cycle counter, for timing short
+ * intervals. It's 32 bits and wraps; take differences of two readings
+ * made on the same CPU.
+ */
+uint32_t cpu_cycles(void);
+
 /*
  * Idle or shut down (respectively) the processor.
  *
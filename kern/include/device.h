@@ -36,16 +36,23 @@
 
 
 struct uio;  /* in <uio.h> */
+struct ioreq;  /* in <iosched.h> */
 
 /*
  * Filesystem-namespace-accessible device.
  * d_io is for both reads and writes; the uio indicates the direction.
+ *
+ * d_submit, which block devices may provide (the rest leave it NULL),
+ * queues a transfer of whole blocks to or from a kernel buffer and
+ * returns without waiting for it; the request's callback reports
+ * completion.
  */
 struct device {
 	int (*d_open)(struct device *, int flags_from_open);
 	int (*d_close)(struct device *);
 	int (*d_io)(struct device *, struct uio *);
 	int (*d_ioctl)(struct device *, int op, userptr_t data);
+	int (*d_submit)(struct device *, struct ioreq *);
 
 	blkcnt_t d_blocks;
 	blksize_t d_blocksize;
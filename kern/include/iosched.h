@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _IOSCHED_H_
+#define _IOSCHED_H_
+
+/*
+ * Disk request scheduling.
+ *
+ * A disk driver puts requests that it can't start yet into its
+ * struct iosched, and whenever the disk goes idle asks it which one
+ * to start next. The choice is made by the current policy:
+ *
+ *    fifo      in the order they arrived
+ *    clook     in increasing sector order from the last position,
+ *              then back to the lowest (circular LOOK)
+ *    deadline  like clook, but a request that has waited while
+ *              IOSCHED_DEADLINE others were started goes next
+ *
+ * Deadlines are counted in dispatches rather than time, which is
+ * what bounds how long a request can be starved by others.
+ *
+ * A request that continues exactly where a queued one ends (or ends
+ * where one starts), in the same direction, is merged with it. The
+ * merged requests come back from iosched_next as a chain, linked
+ * through ir_merged in sector order, to be done back to back. Under
+ * fifo nothing is merged, so the arrival order is kept exactly.
+ *
+ * The driver supplies the locking: every call but iosched_setpolicy
+ * and iosched_printstats must be made holding the lock passed to
+ * iosched_init.
+ */
+
+#include <spinlock.h>
+
+struct ioreq {
+	/* Filled in by whoever submits the request */
+	uint32_t ir_sector;		/* First sector */
+	uint32_t ir_nsect;		/* Number of sectors */
+	void *ir_buf;			/* Kernel buffer, ir_nsect sectors */
+	bool ir_write;			/* Write (otherwise read) */
+	void (*ir_callback)(struct ioreq *req, int result);
+	void *ir_data;			/* For the submitter's use */
+
+	/* Used by the driver and scheduler */
+	uint32_t ir_ndone;		/* Sectors transferred so far */
+	unsigned ir_stamp;		/* Dispatches done when it arrived */
+	struct ioreq *ir_next;		/* Queue */
+	struct ioreq *ir_merged;	/* Next request in a merged run */
+	struct ioreq *ir_mergetail;	/* Last request in a merged run */
+};
+
+/* Dispatches a request may wait through before deadline serves it */
+#define IOSCHED_DEADLINE  16
+
+/* Longest merged run, in sectors */
+#define IOSCHED_MERGEMAX  128
+
+struct iosched {
+	const char *is_name;		/* Device name, for stats */
+	struct spinlock *is_lock;	/* Driver's lock */
+	struct ioreq *is_queue;		/* Waiting runs, oldest first */
+	struct ioreq *is_queuetail;
+	unsigned is_depth;		/* Requests waiting (counting merged) */
+	uint32_t is_pos;		/* Sector after the last one dispatched */
+
+	/* Statistics */
+	unsigned is_adds;		/* Requests queued */
+	unsigned is_depthsum;		/* Sum of is_depth seen by each add */
+	unsigned is_maxdepth;
+	unsigned is_dispatches;		/* Runs handed out */
+	uint64_t is_seeksum;		/* Sum of seek distances, in sectors */
+	unsigned is_merges;
+	unsigned is_expired;		/* Deadline overrides */
+
+	struct iosched *is_nextsched;	/* List of all of them */
+};
+
+/* Set up an empty scheduler for a device and add it to the stats list */
+void iosched_init(struct iosched *is, const char *name,
+		  struct spinlock *lock);
+
+/* Queue a request */
+void iosched_add(struct iosched *is, struct ioreq *req);
+
+/* Take the next run of requests to start, or NULL if none */
+struct ioreq *iosched_next(struct iosched *is);
+
+/* Choose the policy by name: "fifo", "clook" or "deadline" */
+int iosched_setpolicy(const char *name);
+
+/* Print the policy and each device's statistics */
+void iosched_printstats(void);
+
+
+#endif /* _IOSCHED_H_ */
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+/*
+ * Lock contention profiler.
+ *
+ * When the kernel is configured with "options lockprof", spinlocks,
+ * locks and CVs report every acquire and release here. Statistics are
+ * kept per lock and per acquire site (the address acquire was called
+ * from):
+ *
+ *    acquires     times acquired (for a CV, times waited on)
+ *    contended    acquires that found it held
+ *    spins        times round a spin loop waiting for it
+ *    wait         cycles from asking for it to getting it (for a CV,
+ *                 from cv_wait to reacquiring the lock), total and max
+ *    hold         cycles from getting it to releasing it, total and
+ *                 max (not for CVs)
+ *
+ * Times come from cpu_cycles() and are only right when both ends
+ * happen on the same cpu, which for a sleep lock isn't guaranteed.
+ *
+ * Spinlocks have no names; find them, and the sites, in the kernel's
+ * symbol table.
+ *
+ * The table has a fixed size. Once it's full, new lock/site pairs are
+ * counted as dropped and otherwise ignored until it's reset.
+ *
+ * None of this is compiled in without the option, and the hooks in the
+ * lock code vanish too.
+ */
+
+#include "opt-lockprof.h"
+
+#if OPT_LOCKPROF
+
+/* Kinds of lock */
+#define LOCKPROF_SPINLOCK  0
+#define LOCKPROF_LOCK      1
+#define LOCKPROF_CV        2
+
+/* Lock/site pairs that can be tracked */
+#define LOCKPROF_NRECS     1024
+
+/* Called after getting the lock */
+void lockprof_acquired(unsigned kind, const void *lock, const char *name,
+		       vaddr_t site, bool contended, unsigned spins,
+		       uint32_t waitcycles);
+
+/* Called when releasing it; SITE is the one passed to lockprof_acquired */
+void lockprof_released(unsigned kind, const void *lock, vaddr_t site,
+		       uint32_t holdcycles);
+
+/* Print the statistics, busiest first */
+void lockprof_printstats(void);
+
+/* Throw them all away and start again */
+void lockprof_reset(void);
+
+#endif /* OPT_LOCKPROF */
+
+
+#endif /* _LOCKPROF_H_ */
@@ -48,11 +48,43 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking. SFS doesn't use vfs_biglock; instead there are
+ *
+ *    sv_lock          per vnode: the inode, the file's contents and
+ *                     blocks, and the read-ahead state
+ *    sfs_vnlock       per filesystem: the table of loaded vnodes
+ *    sfs_freemaplock  per filesystem: the free block bitmap, the
+ *                     count of reserved blocks, and the superblock
+ *    the buffer cache's own lock (sfs_cache.c)
+ *
+ * taken in that order, and when two vnode locks are needed the
+ * directory's is taken first. Below them all come spinlocks: the VFS
+ * name cache, vnode reference counts, and device wait channels.
+ * vfs_biglock, where the VFS layer still holds it (mount, unmount,
+ * sync), comes before everything here.
+ *
+ * sv_lock is held across disk I/O on the file, and sfs_vnlock while
+ * an inode is read in; the buffer cache's lock never is. User memory,
+ * which can fault and need another file's sv_lock, is never touched
+ * with sv_lock held.
+ */
+
+struct lock;
+struct sfs_dblock;
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
+	struct lock *sv_lock;           /* protects everything but sv_v */
 	bool sv_dirty;                  /* true if sv_i modified */
+	off_t sv_raoffset;		/* where a sequential read would start */
+	uint32_t sv_rawindow;		/* blocks to read ahead of it */
+	uint32_t sv_ranext;		/* first block not yet read ahead */
+	struct sfs_dblock *sv_delayed;	/* data not yet given disk blocks */
+	bool sv_idreserved;		/* a block is reserved for sfi_indirect */
+	struct sfs_vnode *sv_hashnext;	/* chain in sfs_vnhash */
 };
 
 struct sfs_fs {
@@ -60,9 +92,15 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* protects the next four */
+	struct sfs_vnode **sfs_vnhash;  /* vnodes loaded into memory */
+	unsigned sfs_vnhashsize;        /* buckets in sfs_vnhash */
+	unsigned sfs_vncount;           /* vnodes in sfs_vnhash */
+	unsigned sfs_nreclaiming;       /* vnodes out of it, not yet freed */
+	struct lock *sfs_freemaplock;   /* protects the freemap and super */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	uint32_t sfs_nreserved;         /* free blocks promised to sv_delayed */
 };
 
 /*
@@ -84,6 +122,37 @@ int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/*
+ * Buffer cache (sfs_cache.c). sfs_buf_read and sfs_buf_get hand back
+ * a pinned buffer, which must be given back with sfs_buf_release.
+ * sfs_buf_get doesn't read the block, for callers that are going to
+ * overwrite it all. Dirty buffers are written back by sfs_buf_sync.
+ * sfs_buf_prefetch starts a read in the background, if it can.
+ * sfs_buf_present says whether the cache has any buffer for a block,
+ * for I/O that bypasses it.
+ */
+struct sfs_buf;
+
+int sfs_buf_init(void);
+int sfs_buf_read(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+int sfs_buf_get(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+void *sfs_buf_data(struct sfs_buf *buf);
+bool sfs_buf_valid(struct sfs_buf *buf);
+void sfs_buf_markdirty(struct sfs_buf *buf);
+void sfs_buf_release(struct sfs_buf *buf);
+void sfs_buf_prefetch(struct sfs_fs *sfs, uint32_t block);
+bool sfs_buf_iscached(struct sfs_fs *sfs, uint32_t block);
+bool sfs_buf_present(struct sfs_fs *sfs, uint32_t block);
+void sfs_buf_forget(struct sfs_fs *sfs, uint32_t block);
+int sfs_buf_sync(struct sfs_fs *sfs);
+void sfs_buf_dropfs(struct sfs_fs *sfs);
+void sfs_buf_printstats(void);
+
+/* Table of loaded vnodes (in sfs_vnode.c) */
+int sfs_vnhash_init(struct sfs_fs *sfs);
+void sfs_vnhash_cleanup(struct sfs_fs *sfs);
+int sfs_sync_vnodes(struct sfs_fs *sfs);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
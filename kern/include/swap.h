@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space: page-sized slots on a raw disk device.
+ *
+ *    swap_bootstrap - open SWAP_DEVICE and size the slot map. If the
+ *                     device is missing, swapping is simply disabled.
+ *    swap_setdevice - swap on the raw disk DEVNAME (e.g. "lhd2raw:")
+ *                     instead, or on nothing if DEVNAME is NULL. Fails
+ *                     with EBUSY if pages are out in swap now, or if
+ *                     a filesystem is mounted on the disk.
+ *    swap_usesdevice - whether DEV is the swap disk; vfs_mount refuses
+ *                     to mount a filesystem on it.
+ *    swap_enabled   - whether there is a swap device at all.
+ *    swap_alloc     - reserve a free slot. Returns ENOSPC when full.
+ *    swap_free      - release a slot.
+ *    swap_read      - copy a slot into the physical page PADDR.
+ *    swap_write     - copy the physical page PADDR out to a slot.
+ *    swap_usage     - slots in use and total, for statistics.
+ *
+ * swap_read and swap_write sleep, so they must not be called with a
+ * spinlock held.
+ */
+
+/* A disk of its own: lhd0 normally holds the root filesystem */
+#define SWAP_DEVICE "lhd1raw:"
+
+struct device;
+
+void swap_bootstrap(void);
+int  swap_setdevice(const char *devname);
+bool swap_usesdevice(struct device *dev);
+bool swap_enabled(void);
+int  swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+int  swap_read(unsigned slot, paddr_t paddr);
+int  swap_write(unsigned slot, paddr_t paddr);
+void swap_usage(unsigned *used, unsigned *total);
+
+#endif /* _SWAP_H_ */
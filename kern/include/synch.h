@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include "opt-lockprof.h"
 
 /*
  * Dijkstra-style semaphore.
@@ -69,6 +70,10 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
+ * The lock is adaptive: a thread that finds it held spins for a while
+ * if the holder is running on another cpu, since then it is likely to
+ * be released soon, and sleeps otherwise.
+ *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
  */
@@ -80,6 +85,16 @@ struct lock {
 	struct thread *owner; // keeps track of who owns the lock
 	struct spinlock lk_spin; // protects atomic test&set
 	struct wchan *lk_wchan; // place for thread to sleep
+	unsigned lk_waiters; // threads on lk_wchan not yet woken
+
+	/* Statistics, protected by lk_spin */
+	unsigned lk_contended; // acquires that found the lock held
+	unsigned lk_spinwins; // of those, ones that got it by spinning
+	unsigned lk_sleeps; // times a thread slept on lk_wchan
+#if OPT_LOCKPROF
+	vaddr_t lk_site; // where the holder acquired it
+	uint32_t lk_stamp; // cpu_cycles() when it did
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -144,4 +159,56 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of threads may hold the lock for reading at once, or one
+ * thread for writing. Writers are preferred: once a writer is waiting,
+ * new readers wait too, so a stream of readers can't starve it. When
+ * a writer releases the lock, though, every reader that was waiting is
+ * let in (with one wakeup) ahead of the next writer, so a stream of
+ * writers can't starve readers either.
+ *
+ * Because of the writer preference, a thread must not acquire the lock
+ * for reading again while it already holds it; a writer waiting in
+ * between would deadlock them.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+	char *rwlock_name;
+	struct spinlock rw_spin; // protects everything below
+	struct wchan *rw_readwchan; // readers wait here
+	struct wchan *rw_writewchan; // writers wait here
+	unsigned rw_readers; // threads holding it for reading
+	struct thread *rw_writer; // thread holding it for writing, if any
+	unsigned rw_writerswanting; // writers waiting to get in
+	unsigned rw_readsleepers; // readers on rw_readwchan not yet woken
+	unsigned rw_writesleepers; // writers on rw_writewchan not yet woken
+	unsigned rw_readpasses; // woken readers that may pass waiting writers
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock shared with other readers.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock exclusively.
+ *    rwlock_release_write - Give up the write hold.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                   the lock for writing.
+ *
+ * Readers aren't tracked individually, so there is no do_i_hold for
+ * reading.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -30,6 +30,7 @@
 #ifndef _SYSCALL_H_
 #define _SYSCALL_H_
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -67,6 +68,9 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_execv(userptr_t program, userptr_t args);
 #endif // OPT_A2
+#if OPT_A3
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+#endif // OPT_A3
 #endif // UW
 
 #endif /* _SYSCALL_H_ */
@@ -60,6 +60,7 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int rwtest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -74,11 +75,13 @@ int readstress(int, char **);
 int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
+int openstress(int, char **);
 int printfile(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int pagealloctest(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
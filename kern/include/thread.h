@@ -101,6 +101,22 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+	/*
+	 * Scheduler fields (see schedule() in thread.c). The times
+	 * are in hardclocks; t_readystamp is when the thread last
+	 * went on a run queue.
+	 */
+	unsigned t_prio;		/* Priority level, 0 (highest) and up */
+	unsigned t_quantum;		/* Hardclocks run at it since blocking */
+	unsigned t_readystamp;
+	unsigned t_runticks;		/* Total time running */
+	unsigned t_waitticks;		/* Total time runnable but waiting */
+	unsigned t_dispatches;		/* Times picked to run */
+
+	/* Links on the list of all threads (see thread_printstats) */
+	struct thread *t_allprev;
+	struct thread *t_allnext;
+
 	/*
 	 * Public fields
 	 */
@@ -157,16 +173,21 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge a hardclock to the running thread. Called from the timer
+ * interrupt on every tick.
+ */
+void thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Print the scheduler statistics, overall and for each thread.
  */
-void thread_consider_migration(void);
+void thread_printstats(void);
 
 
 #endif /* _THREAD_H_ */
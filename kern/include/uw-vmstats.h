@@ -36,7 +36,18 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_COW_BREAK             (10)
+#define VMSTAT_EVICT_FIFO            (11)
+#define VMSTAT_EVICT_RANDOM          (12)
+#define VMSTAT_EVICT_CLOCK           (13)
+#define VMSTAT_CLEAN_DISCARD         (14)
+#define VMSTAT_CLOCK_SECOND_CHANCE   (15)
+#define VMSTAT_SWTLB_HIT             (16)
+#define VMSTAT_TLB_INVALIDATE_WRAP   (17)
+#define VMSTAT_TLB_INVALIDATE_RETIRE (18)
+#define VMSTAT_TLB_INVALIDATE_PAGEOUT (19)
+#define VMSTAT_TLB_INVALIDATE_CLOCK  (20)
+#define VMSTAT_COUNT                 (21)
 
 /* ----------------------------------------------------------------------- */
 
@@ -157,6 +157,9 @@ int vfs_getcwd(struct uio *buf);
  *                    specified device.
  *
  *    vfs_unmountall - Unmount all mounted filesystems.
+ *
+ *    vfs_devismounted - Check if a filesystem is mounted on DEV. The
+ *                    caller must hold the vfs big lock (see below).
  */
 
 void vfs_bootstrap(void);
@@ -173,6 +176,32 @@ int vfs_mount(const char *devname, void *data,
 			       struct fs **result));
 int vfs_unmount(const char *devname);
 int vfs_unmountall(void);
+bool vfs_devismounted(struct device *dev);
+
+/*
+ * Name lookup cache, mapping (directory vnode, name) to the vnode
+ * found there, or to nothing for names known not to exist. It is
+ * used by filesystems from their lookup routines, and they must keep
+ * it up to date: remove a name whenever it is created, linked,
+ * renamed or removed, and purge a vnode when it is reclaimed, since
+ * the cache doesn't hold references. It has its own (spin)lock, so
+ * these may be called with filesystem locks held.
+ *
+ *    vfs_ncache_lookup  - Returns true if NAME in DIR is cached, with
+ *                         *RET set to the vnode (with a new reference)
+ *                         or to NULL if the name doesn't exist.
+ *    vfs_ncache_enter   - Cache NAME in DIR as VN (NULL: no such name).
+ *    vfs_ncache_remove  - Forget NAME in DIR.
+ *    vfs_ncache_purgevn - Forget every entry for or in VN.
+ */
+
+void vfs_ncache_init(void);
+bool vfs_ncache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **ret);
+void vfs_ncache_enter(struct vnode *dir, const char *name, struct vnode *vn);
+void vfs_ncache_remove(struct vnode *dir, const char *name);
+void vfs_ncache_purgevn(struct vnode *vn);
+void vfs_ncache_printstats(void);
 
 /*
  * Array of vnodes.
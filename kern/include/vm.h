@@ -55,6 +55,12 @@ void vm_bootstrap(void);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/* Print physical page allocator statistics */
+void vm_printstats(void);
+
+/* Choose the page replacement policy: "fifo", "random" or "clock" */
+int vm_setpolicy(const char *name);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
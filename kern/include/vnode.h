@@ -30,6 +30,7 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
 struct stat;
@@ -50,10 +51,13 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * Both counts are protected by vn_countlock.
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
+	struct spinlock vn_countlock;   /* Lock for the counts */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -89,7 +93,10 @@ struct vnode {
  *
  *    vop_reclaim     - Called when vnode is no longer in use. Note that
  *                      this may be substantially after vop_close is
- *                      called.
+ *                      called. It is handed the last reference, but
+ *                      no lock: if someone has picked the vnode up
+ *                      again in the meantime, it should drop that
+ *                      reference and return EBUSY.
  *
  *****************************************
  *
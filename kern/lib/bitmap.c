@@ -47,11 +47,44 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * Above the bits is a summary level: a count of the clear bits in
+ * each group of GROUP_WORDS words. Allocation skips full groups by
+ * looking at the counts, so finding a free bit on a nearly full map
+ * costs a pass over the (much shorter) summary instead of the bits.
+ */
+#define GROUP_WORDS     32
+#define BITS_PER_GROUP  (GROUP_WORDS*BITS_PER_WORD)
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
+        unsigned ngroups;
+        unsigned *nfree;        /* clear bits in each group */
+        unsigned nclear;        /* clear bits in all */
 };
 
+static
+void
+bitmap_countgroup(struct bitmap *b, unsigned g)
+{
+        unsigned ix, offset;
+        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned count = 0;
+
+        for (ix = g*GROUP_WORDS; ix < (g+1)*GROUP_WORDS && ix < maxix; ix++) {
+                if (b->v[ix] == WORD_ALLBITS) {
+                        continue;
+                }
+                for (offset = 0; offset < BITS_PER_WORD; offset++) {
+                        if ((b->v[ix] & ((WORD_TYPE)1 << offset))==0) {
+                                count++;
+                        }
+                }
+        }
+        b->nfree[g] = count;
+}
+
 
 struct bitmap *
 bitmap_create(unsigned nbits)
@@ -69,6 +102,13 @@ bitmap_create(unsigned nbits)
                 kfree(b);
                 return NULL;
         }
+        b->ngroups = DIVROUNDUP(words, GROUP_WORDS);
+        b->nfree = kmalloc(b->ngroups*sizeof(unsigned));
+        if (b->nfree == NULL) {
+                kfree(b->v);
+                kfree(b);
+                return NULL;
+        }
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
@@ -86,6 +126,8 @@ bitmap_create(unsigned nbits)
                 }
         }
 
+        bitmap_recount(b);
+
         return b;
 }
 
@@ -95,31 +137,91 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+void
+bitmap_recount(struct bitmap *b)
+{
+        unsigned g;
+
+        b->nclear = 0;
+        for (g=0; g<b->ngroups; g++) {
+                bitmap_countgroup(b, g);
+                b->nclear += b->nfree[g];
+        }
+}
+
+unsigned
+bitmap_nclear(struct bitmap *b)
+{
+        return b->nclear;
+}
+
+/*
+ * Find a clear bit in [from, to), set it, and return its index.
+ */
+static
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_scan(struct bitmap *b, unsigned from, unsigned to, unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        unsigned bitno = from;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
+        while (bitno < to) {
+                unsigned ix = bitno / BITS_PER_WORD;
+                WORD_TYPE mask = ((WORD_TYPE)1) << (bitno % BITS_PER_WORD);
+
+                if (mask == 1 && b->v[ix] == WORD_ALLBITS) {
+                        bitno += BITS_PER_WORD;
+                        continue;
                 }
+                if ((b->v[ix] & mask)==0) {
+                        b->v[ix] |= mask;
+                        b->nfree[bitno / BITS_PER_GROUP]--;
+                        b->nclear--;
+                        *index = bitno;
+                        return 0;
+                }
+                bitno++;
         }
         return ENOSPC;
 }
 
+int
+bitmap_alloc_near(struct bitmap *b, unsigned hint, unsigned *index)
+{
+        unsigned g, i, from, to;
+
+        if (hint >= b->nbits) {
+                hint = 0;
+        }
+
+        /*
+         * Search forward from the hint, group by group, wrapping
+         * around at the end and finishing with the part of the
+         * hint's group before the hint.
+         */
+        for (i=0; i<=b->ngroups; i++) {
+                g = (hint / BITS_PER_GROUP + i) % b->ngroups;
+                if (b->nfree[g] == 0) {
+                        continue;
+                }
+                from = (i == 0) ? hint : g*BITS_PER_GROUP;
+                to = (i == b->ngroups) ? hint : (g+1)*BITS_PER_GROUP;
+                if (to > b->nbits) {
+                        to = b->nbits;
+                }
+                if (bitmap_scan(b, from, to, index) == 0) {
+                        KASSERT(*index < b->nbits);
+                        return 0;
+                }
+        }
+        return ENOSPC;
+}
+
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        return bitmap_alloc_near(b, 0, index);
+}
+
 static
 inline
 void
@@ -142,6 +244,8 @@ bitmap_mark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)==0);
         b->v[ix] |= mask;
+        b->nfree[index / BITS_PER_GROUP]--;
+        b->nclear--;
 }
 
 void
@@ -155,6 +259,8 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        b->nfree[index / BITS_PER_GROUP]++;
+        b->nclear++;
 }
 
 
@@ -171,6 +277,7 @@ bitmap_isset(struct bitmap *b, unsigned index)
 void
 bitmap_destroy(struct bitmap *b)
 {
+        kfree(b->nfree);
         kfree(b->v);
         kfree(b);
 }
@@ -50,6 +50,10 @@
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
+#if OPT_A3
+#include <uw-vmstats.h>
+#endif
 
 
 /*
@@ -151,6 +155,10 @@ shutdown(void)
 	vfs_clearcurdir();
 	vfs_unmountall();
 
+#if OPT_A3
+	vmstats_print();
+#endif
+
 	thread_shutdown();
 
 	splhigh();
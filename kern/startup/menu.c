@@ -39,12 +39,18 @@
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
+#include <vm.h>
 #include <sfs.h>
+#include <iosched.h>
+#include <swap.h>
+#include <lockprof.h>
 #include <syscall.h>
 #include <test.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-A3.h"
+#include "opt-lockprof.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -407,10 +413,147 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	vm_printstats();
 	
 	return 0;
 }
 
+/*
+ * Command for choosing the order disk requests are done in.
+ */
+static
+int
+cmd_iosched(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: iosched fifo|clook|deadline\n");
+		return EINVAL;
+	}
+
+	result = iosched_setpolicy(args[1]);
+	if (result) {
+		kprintf("iosched: unknown policy %s\n", args[1]);
+	}
+	return result;
+}
+
+static
+int
+cmd_iostats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	iosched_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_ncachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_ncache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
+#if OPT_LOCKPROF
+/*
+ * Command for printing or resetting the lock profile.
+ */
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lockprof_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockprof_reset();
+	}
+	else {
+		kprintf("Usage: lp [reset]\n");
+		return EINVAL;
+	}
+	return 0;
+}
+#endif
+
+#if OPT_SFS
+static
+int
+cmd_sfscachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_buf_printstats();
+
+	return 0;
+}
+#endif
+
+#if OPT_A3
+/*
+ * Command for choosing how pages are picked for eviction.
+ */
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: vmpolicy fifo|random|clock\n");
+		return EINVAL;
+	}
+
+	result = vm_setpolicy(args[1]);
+	if (result) {
+		kprintf("vmpolicy: unknown policy %s\n", args[1]);
+	}
+	return result;
+}
+
+/*
+ * Command for picking the swap disk, e.g. "swapon lhd2raw:", or
+ * "swapon off". Put it first on the boot command line to use a disk
+ * other than SWAP_DEVICE before anything gets paged out.
+ */
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: swapon rawdevice: | off\n");
+		return EINVAL;
+	}
+
+	if (!strcmp(args[1], "off")) {
+		return swap_setdevice(NULL);
+	}
+	return swap_setdevice(args[1]);
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -450,6 +593,11 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[dth]     Enable debugging of DB_THREADS",
+#if OPT_A3
+	"[vmpolicy] Set page replacement policy",
+	"[swapon]  Set swap disk             ",
+#endif
+	"[iosched] Set disk scheduling policy",
 	"[sync]    Sync filesystems          ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
@@ -472,6 +620,7 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] Page allocator throughput     ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -481,6 +630,7 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Rwlock throughput test        ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -490,6 +640,7 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[fs6] FS open stress        (4)     ",
 	NULL
 };
 
@@ -521,6 +672,15 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[io] Disk I/O stats                 ",
+	"[nc] Name cache stats               ",
+	"[ss] Scheduler stats                ",
+#if OPT_LOCKPROF
+	"[lp] Lock profile ([lp reset])      ",
+#endif
+#if OPT_SFS
+	"[bc] SFS buffer cache stats         ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -561,6 +721,11 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "dth",        cmd_dth},
+#if OPT_A3
+	{ "vmpolicy",	cmd_vmpolicy },
+	{ "swapon",	cmd_swapon },
+#endif
+	{ "iosched",	cmd_iosched },
 	{ "sync",	cmd_sync },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
@@ -578,12 +743,22 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "io",		cmd_iostats },
+	{ "nc",		cmd_ncachestats },
+	{ "ss",		cmd_schedstats },
+#if OPT_LOCKPROF
+	{ "lp",		cmd_lockprof },
+#endif
+#if OPT_SFS
+	{ "bc",		cmd_sfscachestats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	pagealloctest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -595,6 +770,7 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwtest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -606,6 +782,7 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+	{ "fs6",	openstress },
 
 	{ NULL, NULL }
 };
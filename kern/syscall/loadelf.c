@@ -60,6 +60,9 @@
 #include <vnode.h>
 #include <elf.h>
 #include "opt-A3.h"
+#if OPT_A3
+#include <stat.h>
+#endif
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -74,16 +77,25 @@
  * executable whose load address is in kernel space. If you should
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
+ *
+ * Under A3 nothing is read here: the segment is only recorded in the
+ * address space and vm_fault pages it in on first touch. We still
+ * check that the file is long enough, because a truncated executable
+ * would otherwise only show up later as a fault in the running program.
  */
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
-	     off_t offset, vaddr_t vaddr, 
+	     off_t offset, vaddr_t vaddr,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
+#if OPT_A3
+	struct stat st;
+#else
 	struct iovec iov;
 	struct uio u;
+#endif
 	int result;
 
 	if (filesize > memsize) {
@@ -91,6 +103,24 @@ load_segment(struct addrspace *as, struct vnode *v,
 		filesize = memsize;
 	}
 
+#if OPT_A3
+	(void)is_executable;
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset + (off_t)filesize > st.st_size) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Deferring %lu bytes at 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_backing(as, v, offset, vaddr, filesize);
+#else
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n", 
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
@@ -144,6 +174,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 	
 	return result;
+#endif /* OPT_A3 */
 }
 
 /*
@@ -12,6 +12,7 @@
 #include <vfs.h>
 #include <kern/fcntl.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 /* this implementation of sys__exit does not do anything with the exit code */
 /* this needs to be fixed to get exit() and waitpid() working properly */
@@ -295,3 +296,15 @@ int sys_execv(userptr_t progname, userptr_t args){
 }
 
 #endif
+
+#if OPT_A3
+/* move the calling process's heap break; returns the old one */
+	int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as = curproc_getas();
+
+	KASSERT(as != NULL);
+	return as_sbrk(as, amount, retval);
+}
+#endif
@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -53,6 +54,7 @@ bitmaptest(int nargs, char **args)
 
 	b = bitmap_create(TESTSIZE);
 	KASSERT(b != NULL);
+	KASSERT(bitmap_nclear(b) == TESTSIZE);
 
 	for (i=0; i<TESTSIZE; i++) {
 		KASSERT(bitmap_isset(b, i)==0);
@@ -101,6 +103,23 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* Allocating near a hint takes the next free bit, wrapping */
+	bitmap_unmark(b, 10);
+	bitmap_unmark(b, 300);
+	bitmap_unmark(b, TESTSIZE-1);
+	KASSERT(bitmap_alloc_near(b, 301, &x)==0 && x==TESTSIZE-1);
+	KASSERT(bitmap_alloc_near(b, 301, &x)==0 && x==10);
+	KASSERT(bitmap_alloc_near(b, TESTSIZE, &x)==0 && x==300);
+	KASSERT(bitmap_alloc_near(b, 0, &x)==ENOSPC);
+	KASSERT(bitmap_nclear(b) == 0);
+
+	/* Changing the raw bits needs a recount */
+	bzero(bitmap_getdata(b), TESTSIZE/CHAR_BIT);
+	bitmap_recount(b);
+	KASSERT(bitmap_alloc(b, &x)==0 && x==0);
+
+	bitmap_destroy(b);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
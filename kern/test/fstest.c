@@ -55,6 +55,7 @@
 #define NCHUNKS  720
 #define NTHREADS 12
 #define NCREATES 32
+#define NOPENS   1000
 
 static struct semaphore *threadsem = NULL;
 
@@ -537,6 +538,83 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Open stress: create a lot of files and keep them all open at once,
+ * so the filesystem has that many vnodes loaded; then look each one
+ * up again by name, which must find the same vnode, and finally
+ * close and remove them all.
+ */
+static
+void
+doopenstress(const char *filesys)
+{
+	struct vnode **vns, *vn;
+	char name[32];
+	char buf[32];
+	char numstr[16];
+	int i, nopen, err;
+	bool failed = false;
+
+	kprintf("*** Starting fs open stress test on %s:\n", filesys);
+
+	vns = kmalloc(NOPENS * sizeof(struct vnode *));
+	if (vns == NULL) {
+		kprintf("*** Out of memory\n");
+		return;
+	}
+
+	for (nopen=0; nopen<NOPENS; nopen++) {
+		snprintf(numstr, sizeof(numstr), "-open%d", nopen);
+		fstest_makename(name, sizeof(name), filesys, numstr);
+		/* vfs_open destroys the string it's passed */
+		strcpy(buf, name);
+		err = vfs_open(buf, O_RDONLY|O_CREAT|O_EXCL, 0664,
+			       &vns[nopen]);
+		if (err) {
+			kprintf("Could not create %s: %s\n",
+				name, strerror(err));
+			failed = true;
+			break;
+		}
+	}
+	kprintf("*** %d files open\n", nopen);
+
+	for (i=0; i<nopen && !failed; i++) {
+		snprintf(numstr, sizeof(numstr), "-open%d", i);
+		fstest_makename(name, sizeof(name), filesys, numstr);
+		strcpy(buf, name);
+		err = vfs_open(buf, O_RDONLY, 0664, &vn);
+		if (err) {
+			kprintf("Could not reopen %s: %s\n",
+				name, strerror(err));
+			failed = true;
+			break;
+		}
+		if (vn != vns[i]) {
+			kprintf("%s: reopen gave a different vnode\n", name);
+			failed = true;
+		}
+		vfs_close(vn);
+	}
+
+	for (i=0; i<nopen; i++) {
+		snprintf(numstr, sizeof(numstr), "-open%d", i);
+		vfs_close(vns[i]);
+		if (fstest_remove(filesys, numstr)) {
+			failed = true;
+		}
+	}
+	kfree(vns);
+
+	if (failed) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+	kprintf("*** fs open stress test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -544,7 +622,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[12345] filesystem:\n");
+		kprintf("Usage: fs[123456] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -576,6 +654,7 @@ DEFTEST(readstress);
 DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(createstress);
+DEFTEST(openstress);
 
 ////////////////////////////////////////////////////////////
 
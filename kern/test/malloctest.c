@@ -32,8 +32,10 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
+#include <vm.h>
 #include <test.h>
 
 /*
@@ -137,3 +139,67 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Time alloc_kpages/free_kpages for blocks of a range of sizes. Each
+ * round grabs PA_BATCH blocks and then gives them all back, so the
+ * page allocator has to split and merge blocks rather than handing
+ * the same one out over and over.
+ */
+
+#define PA_ROUNDS  64
+#define PA_BATCH   16
+
+static const int pa_sizes[] = { 1, 2, 3, 4, 8, 16, 32, 64 };
+
+int
+pagealloctest(int nargs, char **args)
+{
+	vaddr_t blocks[PA_BATCH];
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs;
+	uint64_t totalns;
+	unsigned i, j, k, pairs, failed;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting page allocator throughput test...\n");
+	vm_printstats();
+
+	for (i=0; i<sizeof(pa_sizes)/sizeof(pa_sizes[0]); i++) {
+		pairs = failed = 0;
+		gettime(&s1, &ns1);
+		for (j=0; j<PA_ROUNDS; j++) {
+			for (k=0; k<PA_BATCH; k++) {
+				blocks[k] = alloc_kpages(pa_sizes[i]);
+				if (blocks[k] == 0) {
+					failed++;
+				}
+			}
+			for (k=0; k<PA_BATCH; k++) {
+				if (blocks[k] != 0) {
+					free_kpages(blocks[k]);
+					pairs++;
+				}
+			}
+		}
+		gettime(&s2, &ns2);
+		getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+
+		totalns = (uint64_t)secs * 1000000000 + nsecs;
+		kprintf("%3d pages: %u alloc/free pairs in %lu.%09lu s",
+			pa_sizes[i], pairs, (unsigned long) secs,
+			(unsigned long) nsecs);
+		if (pairs > 0) {
+			kprintf(", %lu ns each",
+				(unsigned long)(totalns / pairs));
+		}
+		kprintf(" (%u failed)\n", failed);
+	}
+
+	vm_printstats();
+	kprintf("Page allocator throughput test done\n");
+
+	return 0;
+}
@@ -42,6 +42,7 @@
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
 #define NTHREADS      32
+#define NRWLOOPS      200
 
 static volatile unsigned long testval1;
 static volatile unsigned long testval2;
@@ -248,6 +249,10 @@ locktest(int nargs, char **args)
 		P(donesem);
 	}
 
+	kprintf("Lock test: %u contended, %u got by spinning, %u sleeps\n",
+		testlock->lk_contended, testlock->lk_spinwins,
+		testlock->lk_sleeps);
+
 #ifdef UW
   cleanitems();
 #endif
@@ -347,3 +352,141 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock test. Runs NTHREADS threads, some of them
+ * writers, for each reader:writer mix in rwtest_nwriters and reports
+ * how long each took. Readers check they never see a write half done
+ * and that nobody writes while they read.
+ */
+
+static struct rwlock *testrwlock;
+static unsigned long rwtest_writers;	/* threads numbered below are writers */
+static struct spinlock rwtest_spin = SPINLOCK_INITIALIZER;
+static unsigned rwtest_nreading;	/* protected by rwtest_spin */
+static unsigned rwtest_maxreading;	/* likewise */
+static volatile bool rwtest_failed;
+
+static const unsigned long rwtest_nwriters[] = { 0, 1, 4, 16, NTHREADS };
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: Mismatch on %s\n", num, msg);
+	rwtest_failed = true;
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned long v1, v2, v3;
+	int i;
+	volatile int j;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num < rwtest_writers) {
+			rwlock_acquire_write(testrwlock);
+			testval1 = num;
+			for (j=0; j<50; j++);
+			testval2 = num*num;
+			testval3 = num%3;
+			if (testval1 != num || testval2 != num*num) {
+				rwfail(num, "write");
+			}
+			rwlock_release_write(testrwlock);
+		}
+		else {
+			rwlock_acquire_read(testrwlock);
+			spinlock_acquire(&rwtest_spin);
+			rwtest_nreading++;
+			if (rwtest_nreading > rwtest_maxreading) {
+				rwtest_maxreading = rwtest_nreading;
+			}
+			spinlock_release(&rwtest_spin);
+
+			v1 = testval1;
+			v2 = testval2;
+			v3 = testval3;
+			if (v2 != v1*v1 || v3 != v1%3) {
+				rwfail(num, "read (torn write)");
+			}
+			for (j=0; j<50; j++);
+			if (testval1 != v1 || testval2 != v2 ||
+			    testval3 != v3) {
+				rwfail(num, "read (write while reading)");
+			}
+
+			spinlock_acquire(&rwtest_spin);
+			rwtest_nreading--;
+			spinlock_release(&rwtest_spin);
+			rwlock_release_read(testrwlock);
+		}
+	}
+	V(donesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	unsigned k;
+	int i, result;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting rwlock test...\n");
+
+	testrwlock = rwlock_create("testrwlock");
+	if (testrwlock == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	testval1 = testval2 = testval3 = 0;
+	rwtest_failed = false;
+
+	for (k=0; k<sizeof(rwtest_nwriters)/sizeof(rwtest_nwriters[0]); k++) {
+		rwtest_writers = rwtest_nwriters[k];
+		rwtest_maxreading = 0;
+
+		gettime(&secs1, &nsecs1);
+		for (i=0; i<NTHREADS; i++) {
+			result = thread_fork("rwtest", NULL, rwtestthread,
+					     NULL, i);
+			if (result) {
+				panic("rwtest: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i=0; i<NTHREADS; i++) {
+			P(donesem);
+		}
+		gettime(&secs2, &nsecs2);
+		getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+
+		kprintf("%2lu readers, %2lu writers: %lu.%03lu seconds for "
+			"%u operations, at most %u reading at once\n",
+			NTHREADS - rwtest_writers, rwtest_writers,
+			(unsigned long)secs,
+			(unsigned long)(nsecs / 1000000),
+			NTHREADS * NRWLOOPS, rwtest_maxreading);
+	}
+
+	rwlock_destroy(testrwlock);
+	testrwlock = NULL;
+
+#ifdef UW
+  cleanitems();
+#endif
+	kprintf(rwtest_failed ? "Rwlock test failed\n" : "Rwlock test done.\n");
+
+	return 0;
+}
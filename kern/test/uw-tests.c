@@ -243,6 +243,21 @@ vmstats_thread(void *junk, unsigned long num)
             }
             break;
 
+          /* Not part of any of the consistency checks */
+          case VMSTAT_COW_BREAK:
+          case VMSTAT_EVICT_FIFO:
+          case VMSTAT_EVICT_RANDOM:
+          case VMSTAT_EVICT_CLOCK:
+          case VMSTAT_CLEAN_DISCARD:
+          case VMSTAT_CLOCK_SECOND_CHANCE:
+          case VMSTAT_SWTLB_HIT:
+          case VMSTAT_TLB_INVALIDATE_WRAP:
+          case VMSTAT_TLB_INVALIDATE_RETIRE:
+          case VMSTAT_TLB_INVALIDATE_PAGEOUT:
+          case VMSTAT_TLB_INVALIDATE_CLOCK:
+            vmstats_inc(j);
+            break;
+
           default:
             kprintf("Unknown stat %d\n", j);
             break;
@@ -47,13 +47,6 @@
  * skimp on that because we have a known-good hardware clock.
  */
 
-/*
- * Timing constants. These should be tuned along with any work done on
- * the scheduler.
- */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
-
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
  */
@@ -115,17 +108,11 @@ timerclock(void)
 void
 hardclock(void)
 {
-	/*
-	 * Collect statistics here as desired.
-	 */
-
 	curcpu->c_hardclocks++;
+	thread_tick();
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
-	}
 	thread_yield();
 }
 
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Lock contention profiler. See lockprof.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <lockprof.h>
+
+#define LOCKPROF_NAMELEN   16	/* Including the terminating null */
+#define LOCKPROF_PRINTMAX  40	/* Lock/site pairs printed */
+
+struct lockprof_rec {
+	const void *lr_lock;		/* NULL if the slot is free */
+	vaddr_t lr_site;
+	unsigned lr_kind;
+	char lr_name[LOCKPROF_NAMELEN];	/* Copied; the lock may go away */
+	unsigned lr_acquires;
+	unsigned lr_contended;
+	uint64_t lr_spins;
+	uint64_t lr_waitsum;
+	uint64_t lr_holdsum;
+	uint32_t lr_waitmax;
+	uint32_t lr_holdmax;
+};
+
+/*
+ * The table, hashed on lock and site with linear probing. It's
+ * protected with a bare spinlock word rather than a struct spinlock,
+ * since those report here.
+ */
+static struct lockprof_rec lockprof_table[LOCKPROF_NRECS];
+static unsigned lockprof_dropped;
+static volatile spinlock_data_t lockprof_lock = SPINLOCK_DATA_INITIALIZER;
+
+static const char *const lockprof_kinds[] = { "spin", "lock", "cv" };
+
+static
+void
+lockprof_lock_acquire(void)
+{
+	splraise(IPL_NONE, IPL_HIGH);
+	while (spinlock_data_get(&lockprof_lock) != 0 ||
+	       spinlock_data_testandset(&lockprof_lock) != 0) {
+		/* spin */
+	}
+}
+
+static
+void
+lockprof_lock_release(void)
+{
+	spinlock_data_set(&lockprof_lock, 0);
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+/*
+ * Find the record for LOCK and SITE. If there isn't one and CREATE is
+ * set, make one, unless the table is full. Returns NULL if none.
+ * Call with the table locked.
+ */
+static
+struct lockprof_rec *
+lockprof_find(unsigned kind, const void *lock, const char *name,
+	      vaddr_t site, bool create)
+{
+	struct lockprof_rec *lr;
+	unsigned slot, i, j;
+
+	slot = (((vaddr_t)lock >> 2) ^ (site * 2654435761U)) % LOCKPROF_NRECS;
+	for (i=0; i<LOCKPROF_NRECS; i++) {
+		lr = &lockprof_table[(slot + i) % LOCKPROF_NRECS];
+		if (lr->lr_lock == lock && lr->lr_site == site &&
+		    lr->lr_kind == kind) {
+			return lr;
+		}
+		if (lr->lr_lock == NULL) {
+			if (!create) {
+				return NULL;
+			}
+			lr->lr_lock = lock;
+			lr->lr_site = site;
+			lr->lr_kind = kind;
+			for (j=0; j<LOCKPROF_NAMELEN-1 && name != NULL &&
+				     name[j] != 0; j++) {
+				lr->lr_name[j] = name[j];
+			}
+			lr->lr_name[j] = 0;
+			return lr;
+		}
+	}
+	if (create) {
+		lockprof_dropped++;
+	}
+	return NULL;
+}
+
+void
+lockprof_acquired(unsigned kind, const void *lock, const char *name,
+		  vaddr_t site, bool contended, unsigned spins,
+		  uint32_t waitcycles)
+{
+	struct lockprof_rec *lr;
+
+	lockprof_lock_acquire();
+	lr = lockprof_find(kind, lock, name, site, true);
+	if (lr != NULL) {
+		lr->lr_acquires++;
+		if (contended) {
+			lr->lr_contended++;
+		}
+		lr->lr_spins += spins;
+		lr->lr_waitsum += waitcycles;
+		if (waitcycles > lr->lr_waitmax) {
+			lr->lr_waitmax = waitcycles;
+		}
+	}
+	lockprof_lock_release();
+}
+
+void
+lockprof_released(unsigned kind, const void *lock, vaddr_t site,
+		  uint32_t holdcycles)
+{
+	struct lockprof_rec *lr;
+
+	lockprof_lock_acquire();
+	/* Not there if it was dropped, or reset while held */
+	lr = lockprof_find(kind, lock, NULL, site, false);
+	if (lr != NULL) {
+		lr->lr_holdsum += holdcycles;
+		if (holdcycles > lr->lr_holdmax) {
+			lr->lr_holdmax = holdcycles;
+		}
+	}
+	lockprof_lock_release();
+}
+
+/*
+ * Printing goes through locks, which report here, so work from a copy
+ * taken with the table locked.
+ */
+void
+lockprof_printstats(void)
+{
+	struct lockprof_rec *copy, tmp;
+	unsigned i, j, n, dropped;
+
+	copy = kmalloc(sizeof(lockprof_table));
+	if (copy == NULL) {
+		kprintf("lockprof: Out of memory\n");
+		return;
+	}
+
+	lockprof_lock_acquire();
+	n = 0;
+	for (i=0; i<LOCKPROF_NRECS; i++) {
+		if (lockprof_table[i].lr_lock != NULL) {
+			copy[n++] = lockprof_table[i];
+		}
+	}
+	dropped = lockprof_dropped;
+	lockprof_lock_release();
+
+	/* Most time spent waiting first */
+	for (i=1; i<n; i++) {
+		tmp = copy[i];
+		for (j=i; j>0 && copy[j-1].lr_waitsum < tmp.lr_waitsum; j--) {
+			copy[j] = copy[j-1];
+		}
+		copy[j] = tmp;
+	}
+
+	kprintf("Lock profile: %u lock/site pairs, %u dropped; "
+		"times in cycles\n", n, dropped);
+	for (i=0; i<n && i<LOCKPROF_PRINTMAX; i++) {
+		kprintf("%-4s %p %-15s at 0x%lx: %u acquires, "
+			"%u contended, %llu spins\n",
+			lockprof_kinds[copy[i].lr_kind], copy[i].lr_lock,
+			copy[i].lr_name, (unsigned long)copy[i].lr_site,
+			copy[i].lr_acquires, copy[i].lr_contended,
+			copy[i].lr_spins);
+		kprintf("    wait %llu total, %u max", copy[i].lr_waitsum,
+			copy[i].lr_waitmax);
+		if (copy[i].lr_kind != LOCKPROF_CV) {
+			kprintf("; hold %llu total, %u max",
+				copy[i].lr_holdsum, copy[i].lr_holdmax);
+		}
+		kprintf("\n");
+	}
+	if (n > LOCKPROF_PRINTMAX) {
+		kprintf("(%u more)\n", n - LOCKPROF_PRINTMAX);
+	}
+
+	kfree(copy);
+}
+
+void
+lockprof_reset(void)
+{
+	lockprof_lock_acquire();
+	bzero(lockprof_table, sizeof(lockprof_table));
+	lockprof_dropped = 0;
+	lockprof_lock_release();
+}
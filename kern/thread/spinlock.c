@@ -35,6 +35,7 @@
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <lockprof.h>
 #include <current.h>	/* for curcpu */
 
 /*
@@ -73,8 +74,15 @@ void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+#if OPT_LOCKPROF
+	uint32_t start;
+	unsigned spins = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
+#if OPT_LOCKPROF
+	start = cpu_cycles();
+#endif
 
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
@@ -99,15 +107,28 @@ spinlock_acquire(struct spinlock *lk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&lk->lk_lock) != 0) {
+#if OPT_LOCKPROF
+			spins++;
+#endif
 			continue;
 		}
 		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
+#if OPT_LOCKPROF
+			spins++;
+#endif
 			continue;
 		}
 		break;
 	}
 
 	lk->lk_holder = mycpu;
+
+#if OPT_LOCKPROF
+	lk->lk_site = (vaddr_t)__builtin_return_address(0);
+	lockprof_acquired(LOCKPROF_SPINLOCK, lk, NULL, lk->lk_site,
+			  spins > 0, spins, cpu_cycles() - start);
+	lk->lk_stamp = cpu_cycles();
+#endif
 }
 
 /*
@@ -121,6 +142,11 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKPROF
+	lockprof_released(LOCKPROF_SPINLOCK, lk, lk->lk_site,
+			  cpu_cycles() - lk->lk_stamp);
+#endif
+
 	lk->lk_holder = NULL;
 	spinlock_data_set(&lk->lk_lock, 0);
 	spllower(IPL_HIGH, IPL_NONE);
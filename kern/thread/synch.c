@@ -38,7 +38,9 @@
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <cpu.h>
 #include <synch.h>
+#include <lockprof.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -147,6 +149,13 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * How many times a thread waiting for a lock looks at it before
+ * giving up spinning and going to sleep, even if the holder is still
+ * running. This bounds the cpu time wasted on long critical sections.
+ */
+#define LOCK_SPIN_MAX 1000
+
 	struct lock *
 lock_create(const char *name)
 {
@@ -173,6 +182,10 @@ lock_create(const char *name)
 	spinlock_init(&lock->lk_spin);
 	lock->held = false;
 	lock->owner = NULL;
+	lock->lk_waiters = 0;
+	lock->lk_contended = 0;
+	lock->lk_spinwins = 0;
+	lock->lk_sleeps = 0;
 	return lock;
 }
 
@@ -180,6 +193,7 @@ lock_create(const char *name)
 lock_destroy(struct lock *lock)
 {
 	KASSERT(lock != NULL);
+	KASSERT(lock->lk_waiters == 0);
 
 	spinlock_cleanup(&lock->lk_spin);
 	wchan_destroy(lock->lk_wchan);	
@@ -190,20 +204,71 @@ lock_destroy(struct lock *lock)
 	void
 lock_acquire(struct lock *lock)
 {
+	struct thread *owner;
+	volatile bool *heldp;
+	unsigned spins = 0;
+	bool spun = false;
+	bool contended;
+#if OPT_LOCKPROF
+	uint32_t start = cpu_cycles();
+#endif
+
 	KASSERT(lock != NULL);
 	KASSERT(!lock_do_i_hold(lock));
 
 	spinlock_acquire(&lock->lk_spin);
+	contended = lock->held;
+	if (contended) {
+		lock->lk_contended++;
+	}
 	while(lock->held){
+		/*
+		 * If the holder is running on another cpu it will
+		 * probably let go soon, and spinning is cheaper than
+		 * two context switches. The holder can't go away while
+		 * we hold lk_spin, since it needs lk_spin to release.
+		 */
+		owner = lock->owner;
+		if (spins < LOCK_SPIN_MAX && owner != NULL &&
+		    owner->t_state == S_RUN && owner->t_cpu != curcpu) {
+			spinlock_release(&lock->lk_spin);
+			/*
+			 * Read held afresh from memory every time round,
+			 * not from a register; the holder clears it on
+			 * another cpu.
+			 */
+			heldp = &lock->held;
+			while (*heldp && spins < LOCK_SPIN_MAX) {
+				spins++;
+			}
+			spun = true;
+			spinlock_acquire(&lock->lk_spin);
+			continue;
+		}
+
+		// sleep; lock_release wakes one waiter if there are any
+		lock->lk_waiters++;
+		lock->lk_sleeps++;
+		spun = false;
 		wchan_lock(lock->lk_wchan);
 		spinlock_release(&lock->lk_spin);
 		wchan_sleep(lock->lk_wchan);
 		spinlock_acquire(&lock->lk_spin);
 	}
 	// we now own the spinlock
+	if (spun) {
+		lock->lk_spinwins++;
+	}
 	lock->held = true;
 	lock->owner = curthread;
 	spinlock_release(&lock->lk_spin);
+
+#if OPT_LOCKPROF
+	lock->lk_site = (vaddr_t)__builtin_return_address(0);
+	lockprof_acquired(LOCKPROF_LOCK, lock, lock->lk_name, lock->lk_site,
+			  contended, spins, cpu_cycles() - start);
+	lock->lk_stamp = cpu_cycles();
+#endif
 }
 
 	void
@@ -212,10 +277,19 @@ lock_release(struct lock *lock)
 	KASSERT(lock != NULL);
 	KASSERT(lock_do_i_hold(lock));	
 
+#if OPT_LOCKPROF
+	lockprof_released(LOCKPROF_LOCK, lock, lock->lk_site,
+			  cpu_cycles() - lock->lk_stamp);
+#endif
+
 	spinlock_acquire(&lock->lk_spin);
 	lock->held = false;
 	lock->owner = NULL;
-	wchan_wakeone(lock->lk_wchan);
+	// nobody asleep is the common case; don't touch the wchan then
+	if (lock->lk_waiters > 0) {
+		lock->lk_waiters--;
+		wchan_wakeone(lock->lk_wchan);
+	}
 	spinlock_release(&lock->lk_spin);
 }
 
@@ -275,6 +349,10 @@ cv_destroy(struct cv *cv)
 	void
 cv_wait(struct cv *cv, struct lock *lock)
 {
+#if OPT_LOCKPROF
+	uint32_t start = cpu_cycles();
+#endif
+
 	KASSERT(cv != NULL);
 	KASSERT(lock != NULL);
 
@@ -283,6 +361,12 @@ cv_wait(struct cv *cv, struct lock *lock)
 	lock_release(lock);
 	wchan_sleep(cv->cv_wchan);
 	lock_acquire(lock);
+
+#if OPT_LOCKPROF
+	lockprof_acquired(LOCKPROF_CV, cv, cv->cv_name,
+			  (vaddr_t)__builtin_return_address(0), false, 0,
+			  cpu_cycles() - start);
+#endif
 }
 
 	void
@@ -308,3 +392,156 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 
 	wchan_wakeall(cv->cv_wchan);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+	struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rwlock_name = kstrdup(name);
+	if (rw->rwlock_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_writewchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_spin);
+	rw->rw_readers = 0;
+	rw->rw_writer = NULL;
+	rw->rw_writerswanting = 0;
+	rw->rw_readsleepers = 0;
+	rw->rw_writesleepers = 0;
+	rw->rw_readpasses = 0;
+	return rw;
+}
+
+	void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_writerswanting == 0);
+
+	spinlock_cleanup(&rw->rw_spin);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+	kfree(rw->rwlock_name);
+	kfree(rw);
+}
+
+	void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(!rwlock_do_i_hold_write(rw));
+
+	spinlock_acquire(&rw->rw_spin);
+	while (rw->rw_writer != NULL ||
+	       (rw->rw_writerswanting > 0 && rw->rw_readpasses == 0)) {
+		rw->rw_readsleepers++;
+		wchan_lock(rw->rw_readwchan);
+		spinlock_release(&rw->rw_spin);
+		wchan_sleep(rw->rw_readwchan);
+		spinlock_acquire(&rw->rw_spin);
+	}
+	if (rw->rw_readpasses > 0) {
+		rw->rw_readpasses--;
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_spin);
+}
+
+	void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_spin);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	// the last reader out lets a writer in
+	if (rw->rw_readers == 0 && rw->rw_readpasses == 0 &&
+	    rw->rw_writesleepers > 0) {
+		rw->rw_writesleepers--;
+		wchan_wakeone(rw->rw_writewchan);
+	}
+	spinlock_release(&rw->rw_spin);
+}
+
+	void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(!rwlock_do_i_hold_write(rw));
+
+	spinlock_acquire(&rw->rw_spin);
+	rw->rw_writerswanting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0 ||
+	       rw->rw_readpasses > 0) {
+		rw->rw_writesleepers++;
+		wchan_lock(rw->rw_writewchan);
+		spinlock_release(&rw->rw_spin);
+		wchan_sleep(rw->rw_writewchan);
+		spinlock_acquire(&rw->rw_spin);
+	}
+	rw->rw_writerswanting--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_spin);
+}
+
+	void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rwlock_do_i_hold_write(rw));
+
+	spinlock_acquire(&rw->rw_spin);
+	rw->rw_writer = NULL;
+	if (rw->rw_readsleepers > 0) {
+		/*
+		 * Let every waiting reader in at once, ahead of any
+		 * waiting writers; the last of them to leave wakes the
+		 * next writer.
+		 */
+		rw->rw_readpasses += rw->rw_readsleepers;
+		rw->rw_readsleepers = 0;
+		wchan_wakeall(rw->rw_readwchan);
+	}
+	else if (rw->rw_writesleepers > 0) {
+		rw->rw_writesleepers--;
+		wchan_wakeone(rw->rw_writewchan);
+	}
+	spinlock_release(&rw->rw_spin);
+}
+
+	bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	return rw->rw_writer == curthread;
+}
@@ -49,6 +49,7 @@
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
+#include <clock.h>
 #include <vnode.h>
 
 #include "opt-synchprobs.h"
@@ -72,6 +73,17 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Hardclocks since boot, as counted by cpu 0; for timing waits. */
+static volatile unsigned sched_ticks;
+
+/*
+ * Every thread from creation until destruction, for printing its
+ * scheduler counters. This is a list threaded through the threads
+ * themselves so adding to it can't fail or need to allocate.
+ */
+static struct thread *allthreads;
+static struct spinlock allthreads_lock = SPINLOCK_INITIALIZER;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -149,6 +161,23 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Scheduler fields; new threads start at the top */
+	thread->t_prio = 0;
+	thread->t_quantum = 0;
+	thread->t_readystamp = 0;
+	thread->t_runticks = 0;
+	thread->t_waitticks = 0;
+	thread->t_dispatches = 0;
+
+	spinlock_acquire(&allthreads_lock);
+	thread->t_allprev = NULL;
+	thread->t_allnext = allthreads;
+	if (allthreads != NULL) {
+		allthreads->t_allprev = thread;
+	}
+	allthreads = thread;
+	spinlock_release(&allthreads_lock);
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -168,6 +197,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -180,19 +210,36 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_asid = 0;
+	c->c_asidgen = 0;
+	c->c_demotions = 0;
+	c->c_boosts = 0;
+	c->c_steals = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<CPU_NPRIO; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+		c->c_runticks[i] = 0;
+		c->c_dispatches[i] = 0;
+		c->c_waitticks[i] = 0;
+	}
+	c->c_runcount = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
 
+	c->c_pagecache_count = 0;
+	c->c_pagecache_hits = 0;
+	c->c_pagecache_misses = 0;
+	spinlock_init(&c->c_pagecache_lock);
+
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+	c->c_stealrand = 0x9e3779b9 * (c->c_number + 1);	/* not 0 */
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -227,6 +274,22 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Look up CPUs by software number.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned num)
+{
+	KASSERT(num < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Destroy a thread.
  *
@@ -255,6 +318,19 @@ thread_destroy(struct thread *thread)
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
+	spinlock_acquire(&allthreads_lock);
+	if (thread->t_allprev != NULL) {
+		thread->t_allprev->t_allnext = thread->t_allnext;
+	}
+	else {
+		KASSERT(allthreads == thread);
+		allthreads = thread->t_allnext;
+	}
+	if (thread->t_allnext != NULL) {
+		thread->t_allnext->t_allprev = thread->t_allprev;
+	}
+	spinlock_release(&allthreads_lock);
+
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
@@ -289,6 +365,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -300,12 +378,15 @@ thread_panic(void)
 	 * Drop runnable threads on the floor.
 	 *
 	 * Don't try to get the run queue lock; we might not be able
-	 * to.  Instead, blat the list structure by hand, and take the
+	 * to.  Instead, blat the list structures by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<CPU_NPRIO; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -426,6 +507,202 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue operations. Each cpu has one run queue per priority
+ * level; threads are taken from the highest-priority (lowest
+ * numbered) nonempty one. The caller holds the cpu's run queue lock.
+ */
+
+/* Queue T at the tail of its level. */
+static
+void
+runq_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_prio < CPU_NPRIO);
+	threadlist_addtail(&c->c_runqueue[t->t_prio], t);
+	c->c_runcount++;
+}
+
+/* Take the thread that should run next, or NULL. */
+static
+struct thread *
+runq_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<CPU_NPRIO; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* Take the thread that would run last, or NULL. */
+static
+struct thread *
+runq_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=CPU_NPRIO; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* Whether anything is queued at level PRIO or above. */
+static
+bool
+runq_hasprio(struct cpu *c, unsigned prio)
+{
+	unsigned i;
+
+	for (i=0; i<=prio && i<CPU_NPRIO; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Work stealing.
+ *
+ * Rather than have busy cpus periodically push threads to idle ones,
+ * a cpu that runs out of work takes it: each time round the idle loop
+ * it looks at two other cpus chosen at random, and takes the thread
+ * that would run last on whichever has more queued. Idle cpus come
+ * round every hardclock, and are poked with an IPI when a thread is
+ * queued on a busy cpu, so ready threads don't wait long for a cpu
+ * that has nothing to do. Looking at two random cpus instead of all of
+ * them keeps the cost constant and the victims spread out, and is
+ * nearly as good at finding the busiest.
+ *
+ * Migrating threads isn't free because of cache affinity; a thread's
+ * working cache set will end up having to be moved to the other CPU.
+ * Stealing only from idle cpus moves threads only when some cpu would
+ * otherwise be wasted. (System/161 does not (yet) model such cache
+ * effects anyway.)
+ */
+
+/*
+ * Choose another cpu at random. There must be at least two.
+ */
+static
+struct cpu *
+steal_pickcpu(unsigned numcpus)
+{
+	uint32_t r;
+	unsigned i;
+
+	/* xorshift; random() is a device and too slow to use here */
+	r = curcpu->c_stealrand;
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	curcpu->c_stealrand = r;
+
+	i = r % (numcpus - 1);
+	if (i >= curcpu->c_number) {
+		i++;
+	}
+	return cpuarray_get(&allcpus, i);
+}
+
+/*
+ * Take a ready thread from some other cpu for this one to run, or
+ * return NULL. Called from the idle loop with interrupts off and no
+ * run queue locks held.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *victim, *other;
+	struct thread *t;
+	unsigned numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	if (numcpus < 2) {
+		return NULL;
+	}
+
+	/* The counts are read unlocked; they're only a hint */
+	victim = steal_pickcpu(numcpus);
+	other = steal_pickcpu(numcpus);
+	if (other->c_runcount > victim->c_runcount) {
+		victim = other;
+	}
+	if (victim->c_runcount == 0) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runq_remtail(victim);
+	if (t != NULL && t == victim->c_curthread) {
+		/*
+		 * Ordinarily, a cpu's curthread will not appear on
+		 * its run queue. However, it can under the following
+		 * circumstances:
+		 *   - it went to sleep;
+		 *   - the processor became idle, so it
+		 *     remained curthread;
+		 *   - it was reawakened, so it was put on the
+		 *     run queue;
+		 *   - and the processor hasn't fully unidled
+		 *     yet, so all these things are still true.
+		 *
+		 * *Migrating* it in this state can cause bad things
+		 * to happen (Exercise: Why? And what?) so put it back
+		 * where it was; it's about to run anyway.
+		 */
+		runq_add(victim, t);
+		t = NULL;
+	}
+	if (t != NULL) {
+		t->t_cpu = curcpu->c_self;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t != NULL) {
+		curcpu->c_steals++;
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u\n",
+		      t->t_name, victim->c_number, curcpu->c_number);
+	}
+	return t;
+}
+
+/*
+ * A thread was just queued on BUSYCPU, which is running something
+ * else. Poke a randomly chosen other cpu if it's idle so it can come
+ * and take the thread right away. Called with interrupts off.
+ */
+static
+void
+steal_poke(struct cpu *busycpu)
+{
+	struct cpu *c;
+	unsigned numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	if (numcpus < 2) {
+		return;
+	}
+	c = steal_pickcpu(numcpus);
+	if (c != busycpu && c->c_isidle) {
+		ipi_send(c, IPI_UNIDLE);
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +727,8 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	target->t_readystamp = sched_ticks;
+	runq_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -458,6 +736,10 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else {
+		/* It has to wait unless another cpu takes it */
+		steal_poke(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -573,8 +855,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * If yielding and nothing of the same or higher priority is
+	 * waiting, keep running.
+	 */
+	if (newstate == S_READY && !runq_hasprio(curcpu, cur->t_prio)) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -588,6 +873,16 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
+		/*
+		 * Blocking before the quantum is up is what
+		 * interactive and I/O-bound threads do; move up a
+		 * level and start a fresh quantum.
+		 */
+		if (cur->t_prio > 0) {
+			cur->t_prio--;
+		}
+		cur->t_quantum = 0;
+
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -632,15 +927,24 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runq_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	/* Account for how long it waited */
+	next->t_waitticks += sched_ticks - next->t_readystamp;
+	next->t_dispatches++;
+	curcpu->c_waitticks[next->t_prio] += sched_ticks - next->t_readystamp;
+	curcpu->c_dispatches[next->t_prio]++;
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -802,6 +1106,10 @@ thread_exit(void)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	DEBUG(DB_THREADS, "Thread %s: ran %u ticks, waited %u, %u dispatches\n",
+	      cur->t_name, cur->t_runticks, cur->t_waitticks,
+	      cur->t_dispatches);
+
 	/* Interrupts off on this processor */
         splhigh();
 	thread_switch(S_ZOMBIE, NULL);
@@ -822,139 +1130,166 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each cpu has CPU_NPRIO run
+ * queues, 0 being the highest priority, and always runs the first
+ * thread of the highest nonempty one. New threads start at level 0.
+ * A thread that runs for SCHEDULE_HARDCLOCKS ticks without blocking
+ * has used up its quantum and drops a level (thread_tick); one that
+ * blocks first moves up a level (thread_switch). So compute-bound
+ * threads sink and interactive ones stay near the top, where they
+ * preempt the others as soon as they wake up.
+ *
+ * So that threads at the bottom can't be starved forever, every
+ * SCHEDULE_BOOST_HARDCLOCKS schedule() moves everything back up to
+ * level 0, in its existing order.
  */
 
+/* How often everything is moved back to the top */
+#define SCHEDULE_BOOST_HARDCLOCKS  HZ
+
+/*
+ * Charge the current thread for a hardclock tick. Called from
+ * hardclock().
+ */
 void
-schedule(void)
+thread_tick(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *cur;
+
+	if (curcpu->c_number == 0) {
+		sched_ticks++;
+	}
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	cur = curthread;
+	KASSERT(cur->t_prio < CPU_NPRIO);
+	cur->t_runticks++;
+	curcpu->c_runticks[cur->t_prio]++;
+	cur->t_quantum++;
+	if (cur->t_quantum >= SCHEDULE_HARDCLOCKS) {
+		if (cur->t_prio < CPU_NPRIO - 1) {
+			cur->t_prio++;
+			curcpu->c_demotions++;
+		}
+		cur->t_quantum = 0;
+	}
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * This is called periodically from hardclock(), and does the
+ * anti-starvation boost.
  */
 void
-thread_consider_migration(void)
+schedule(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
 	struct thread *t;
+	unsigned i;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
-
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	if (curcpu->c_hardclocks % SCHEDULE_BOOST_HARDCLOCKS != 0) {
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	for (i=1; i<CPU_NPRIO; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+		       != NULL) {
+			t->t_prio = 0;
+			t->t_quantum = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+		}
 	}
+	curthread->t_prio = 0;
+	curthread->t_quantum = 0;
+	curcpu->c_boosts++;
 	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+/*
+ * Name of a thread state, for printing.
+ */
+static
+const char *
+thread_statename(threadstate_t state)
+{
+	switch (state) {
+	    case S_RUN:
+		return "run";
+	    case S_READY:
+		return "ready";
+	    case S_SLEEP:
+		return "sleep";
+	    case S_ZOMBIE:
+		return "zombie";
+	}
+	return "?";
+}
+
+/*
+ * Print the scheduler's statistics, summed over all cpus, and then
+ * each thread's own counters. Times are in hardclocks.
+ */
+void
+thread_printstats(void)
+{
+	unsigned runticks[CPU_NPRIO], dispatches[CPU_NPRIO];
+	unsigned waitticks[CPU_NPRIO];
+	unsigned demotions, boosts, steals;
+	unsigned i, j, numcpus;
+	struct cpu *c;
+	struct thread *t;
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+	for (j=0; j<CPU_NPRIO; j++) {
+		runticks[j] = dispatches[j] = waitticks[j] = 0;
+	}
+	demotions = boosts = steals = 0;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		for (j=0; j<CPU_NPRIO; j++) {
+			runticks[j] += c->c_runticks[j];
+			dispatches[j] += c->c_dispatches[j];
+			waitticks[j] += c->c_waitticks[j];
 		}
+		demotions += c->c_demotions;
+		boosts += c->c_boosts;
+		steals += c->c_steals;
 		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	kprintf("Scheduler: %u levels, quantum %u hardclocks, HZ %u\n",
+		CPU_NPRIO, SCHEDULE_HARDCLOCKS, HZ);
+	for (j=0; j<CPU_NPRIO; j++) {
+		kprintf("    level %u: %u ticks run, %u dispatches", j,
+			runticks[j], dispatches[j]);
+		if (dispatches[j] > 0) {
+			kprintf(", %u.%02u average wait",
+				waitticks[j] / dispatches[j],
+				(waitticks[j] % dispatches[j]) * 100
+				/ dispatches[j]);
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+		kprintf("\n");
 	}
+	kprintf("    %u demotions, %u boosts, %u threads stolen\n",
+		demotions, boosts, steals);
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	/*
+	 * The per-thread counters are updated by whichever cpu the
+	 * thread is on without allthreads_lock, so this is a snapshot
+	 * that may be a tick out; that's good enough for looking at.
+	 */
+	kprintf("    %-16s %6s %4s %8s %8s %10s\n", "thread", "state",
+		"prio", "run", "wait", "dispatches");
+	spinlock_acquire(&allthreads_lock);
+	for (t = allthreads; t != NULL; t = t->t_allnext) {
+		kprintf("    %-16s %6s %4u %8u %8u %10u\n", t->t_name,
+			thread_statename(t->t_state), t->t_prio,
+			t->t_runticks, t->t_waitticks, t->t_dispatches);
+	}
+	spinlock_release(&allthreads_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Disk request scheduling. See iosched.h.
+ *
+ * Queues are short (one entry per thread waiting on the disk, more or
+ * less), so each choice is a linear scan of the queue.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <iosched.h>
+
+#define IOSCHED_POLICY_FIFO      0
+#define IOSCHED_POLICY_CLOOK     1
+#define IOSCHED_POLICY_DEADLINE  2
+#define IOSCHED_NPOLICIES        3
+
+static const char *const iosched_names[IOSCHED_NPOLICIES] = {
+	"fifo", "clook", "deadline",
+};
+
+static unsigned iosched_policy = IOSCHED_POLICY_CLOOK;
+
+/* All the schedulers, for iosched_printstats */
+static struct iosched *iosched_list;
+static struct spinlock iosched_listlock = SPINLOCK_INITIALIZER;
+
+void
+iosched_init(struct iosched *is, const char *name, struct spinlock *lock)
+{
+	is->is_name = name;
+	is->is_lock = lock;
+	is->is_queue = is->is_queuetail = NULL;
+	is->is_depth = 0;
+	is->is_pos = 0;
+	is->is_adds = 0;
+	is->is_depthsum = 0;
+	is->is_maxdepth = 0;
+	is->is_dispatches = 0;
+	is->is_seeksum = 0;
+	is->is_merges = 0;
+	is->is_expired = 0;
+
+	spinlock_acquire(&iosched_listlock);
+	is->is_nextsched = iosched_list;
+	iosched_list = is;
+	spinlock_release(&iosched_listlock);
+}
+
+int
+iosched_setpolicy(const char *name)
+{
+	unsigned k;
+
+	for (k=0; k<IOSCHED_NPOLICIES; k++) {
+		if (!strcmp(name, iosched_names[k])) {
+			iosched_policy = k;
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+/* Sector after the end of a run */
+static
+uint32_t
+iosched_runend(struct ioreq *run)
+{
+	struct ioreq *last = run->ir_mergetail;
+
+	return last->ir_sector + last->ir_nsect;
+}
+
+/* Total sectors in a run */
+static
+uint32_t
+iosched_runlen(struct ioreq *run)
+{
+	return iosched_runend(run) - run->ir_sector;
+}
+
+/*
+ * Try to merge REQ into a queued run. Only whole runs are extended,
+ * at either end, so every run stays contiguous and in sector order.
+ */
+static
+bool
+iosched_merge(struct iosched *is, struct ioreq *req)
+{
+	struct ioreq **p, *run;
+
+	for (p = &is->is_queue; *p != NULL; p = &(*p)->ir_next) {
+		run = *p;
+		if (run->ir_write != req->ir_write ||
+		    iosched_runlen(run) + req->ir_nsect > IOSCHED_MERGEMAX) {
+			continue;
+		}
+
+		if (iosched_runend(run) == req->ir_sector) {
+			/* Back merge: REQ goes on the end */
+			run->ir_mergetail->ir_merged = req;
+			run->ir_mergetail = req;
+			return true;
+		}
+
+		if (req->ir_sector + req->ir_nsect == run->ir_sector) {
+			/* Front merge: REQ takes the run's place */
+			req->ir_merged = run;
+			req->ir_mergetail = run->ir_mergetail;
+			req->ir_stamp = run->ir_stamp;
+			req->ir_next = run->ir_next;
+			*p = req;
+			if (is->is_queuetail == run) {
+				is->is_queuetail = req;
+			}
+			run->ir_next = NULL;
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+iosched_add(struct iosched *is, struct ioreq *req)
+{
+	KASSERT(spinlock_do_i_hold(is->is_lock));
+
+	req->ir_stamp = is->is_dispatches;
+	req->ir_next = NULL;
+	req->ir_merged = NULL;
+	req->ir_mergetail = req;
+
+	is->is_adds++;
+	is->is_depthsum += is->is_depth;
+	is->is_depth++;
+	if (is->is_depth > is->is_maxdepth) {
+		is->is_maxdepth = is->is_depth;
+	}
+
+	if (iosched_policy != IOSCHED_POLICY_FIFO && iosched_merge(is, req)) {
+		is->is_merges++;
+		return;
+	}
+
+	if (is->is_queuetail != NULL) {
+		is->is_queuetail->ir_next = req;
+	}
+	else {
+		is->is_queue = req;
+	}
+	is->is_queuetail = req;
+}
+
+/*
+ * C-LOOK: the lowest run at or past the current position, or failing
+ * that the lowest one. Returns a pointer to the link to it.
+ */
+static
+struct ioreq **
+iosched_clook(struct iosched *is)
+{
+	struct ioreq **p, **ahead = NULL, **lowest = NULL;
+	uint32_t sector;
+
+	for (p = &is->is_queue; *p != NULL; p = &(*p)->ir_next) {
+		sector = (*p)->ir_sector;
+		if (lowest == NULL || sector < (*lowest)->ir_sector) {
+			lowest = p;
+		}
+		if (sector >= is->is_pos &&
+		    (ahead == NULL || sector < (*ahead)->ir_sector)) {
+			ahead = p;
+		}
+	}
+	return ahead != NULL ? ahead : lowest;
+}
+
+struct ioreq *
+iosched_next(struct iosched *is)
+{
+	struct ioreq **p, *run, *r;
+	uint32_t sector;
+
+	KASSERT(spinlock_do_i_hold(is->is_lock));
+
+	if (is->is_queue == NULL) {
+		return NULL;
+	}
+
+	switch (iosched_policy) {
+	    case IOSCHED_POLICY_FIFO:
+		p = &is->is_queue;
+		break;
+	    case IOSCHED_POLICY_DEADLINE:
+		/* The queue is in arrival order, so the head is oldest */
+		if (is->is_dispatches - is->is_queue->ir_stamp
+		    >= IOSCHED_DEADLINE) {
+			p = &is->is_queue;
+			is->is_expired++;
+			break;
+		}
+		p = iosched_clook(is);
+		break;
+	    default:
+		p = iosched_clook(is);
+		break;
+	}
+
+	run = *p;
+	*p = run->ir_next;
+	if (is->is_queuetail == run) {
+		/* Find the new tail */
+		is->is_queuetail = NULL;
+		for (r = is->is_queue; r != NULL; r = r->ir_next) {
+			is->is_queuetail = r;
+		}
+	}
+	run->ir_next = NULL;
+
+	for (r = run; r != NULL; r = r->ir_merged) {
+		KASSERT(is->is_depth > 0);
+		is->is_depth--;
+	}
+
+	sector = run->ir_sector;
+	is->is_seeksum += sector > is->is_pos ?
+		sector - is->is_pos : is->is_pos - sector;
+	is->is_pos = iosched_runend(run);
+	is->is_dispatches++;
+
+	return run;
+}
+
+void
+iosched_printstats(void)
+{
+	struct iosched *is;
+	unsigned adds, depthsum, maxdepth, depth;
+	unsigned dispatches, merges, expired;
+	uint64_t seeksum;
+
+	kprintf("I/O scheduling policy: %s\n", iosched_names[iosched_policy]);
+
+	/* Entries are never removed, so the list can be walked unlocked */
+	spinlock_acquire(&iosched_listlock);
+	is = iosched_list;
+	spinlock_release(&iosched_listlock);
+
+	for (; is != NULL; is = is->is_nextsched) {
+		spinlock_acquire(is->is_lock);
+		adds = is->is_adds;
+		depthsum = is->is_depthsum;
+		maxdepth = is->is_maxdepth;
+		depth = is->is_depth;
+		dispatches = is->is_dispatches;
+		seeksum = is->is_seeksum;
+		merges = is->is_merges;
+		expired = is->is_expired;
+		spinlock_release(is->is_lock);
+
+		kprintf("%s: %u requests, %u merged, %u dispatched\n",
+			is->is_name, adds, merges, dispatches);
+		kprintf("    queue depth %u now, %u max", depth, maxdepth);
+		if (adds > 0) {
+			kprintf(", %u.%02u average", depthsum / adds,
+				(depthsum % adds) * 100 / adds);
+		}
+		kprintf("\n");
+		if (dispatches > 0) {
+			kprintf("    average seek %u sectors",
+				(unsigned)(seeksum / dispatches));
+			if (expired > 0) {
+				kprintf(", %u deadline overrides", expired);
+			}
+			kprintf("\n");
+		}
+	}
+}
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Name lookup cache. See vfs.h.
+ *
+ * There is a fixed pool of entries, each either on a hash chain
+ * (keyed by directory vnode and name) or free. All of them are also
+ * on an LRU list, most recently used first and free ones at the
+ * tail, so a new entry always takes the tail.
+ *
+ * Entries don't hold references to the vnodes they name; instead
+ * the filesystem calls vfs_ncache_purgevn when it reclaims a vnode.
+ * Everything is protected by nc_lock, and a hit takes its reference
+ * to the vnode before letting go of it. So once a filesystem has
+ * purged a vnode, no one can find it here, and a refcount it checks
+ * after that includes everyone who did.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <vnode.h>
+
+/* Names longer than this aren't cached */
+#define NC_NAMELEN  31
+
+#define NC_NENTRIES 256
+#define NC_NHASH    64		/* must be a power of 2 */
+
+struct ncentry {
+	struct vnode *nc_dir;		/* NULL if free */
+	struct vnode *nc_vn;		/* NULL for a negative entry */
+	char nc_name[NC_NAMELEN+1];
+	struct ncentry *nc_hashnext;
+	struct ncentry *nc_lruprev;
+	struct ncentry *nc_lrunext;
+};
+
+static struct ncentry nc_entries[NC_NENTRIES];
+static struct ncentry *nc_hash[NC_NHASH];
+static struct ncentry *nc_lruhead, *nc_lrutail;
+static struct spinlock nc_lock = SPINLOCK_INITIALIZER;
+
+/* Statistics */
+static unsigned nc_hits;		/* found a vnode */
+static unsigned nc_neghits;		/* found that the name doesn't exist */
+static unsigned nc_misses;
+static unsigned nc_enters;
+static unsigned nc_evictions;		/* live entries replaced */
+
+void
+vfs_ncache_init(void)
+{
+	unsigned i;
+
+	for (i=0; i<NC_NENTRIES; i++) {
+		nc_entries[i].nc_dir = NULL;
+		nc_entries[i].nc_vn = NULL;
+		nc_entries[i].nc_hashnext = NULL;
+		nc_entries[i].nc_lruprev = i>0 ? &nc_entries[i-1] : NULL;
+		nc_entries[i].nc_lrunext =
+			i+1<NC_NENTRIES ? &nc_entries[i+1] : NULL;
+	}
+	nc_lruhead = &nc_entries[0];
+	nc_lrutail = &nc_entries[NC_NENTRIES-1];
+	for (i=0; i<NC_NHASH; i++) {
+		nc_hash[i] = NULL;
+	}
+}
+
+static
+unsigned
+nc_hashfunc(struct vnode *dir, const char *name)
+{
+	uint32_t h;
+
+	h = (uint32_t)(uintptr_t)dir >> 4;
+	while (*name) {
+		h = h*31 + (unsigned char)*name++;
+	}
+	return h & (NC_NHASH-1);
+}
+
+static
+void
+nc_lru_unlink(struct ncentry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		nc_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		nc_lrutail = nc->nc_lruprev;
+	}
+}
+
+static
+void
+nc_lru_addhead(struct ncentry *nc)
+{
+	nc->nc_lruprev = NULL;
+	nc->nc_lrunext = nc_lruhead;
+	if (nc_lruhead != NULL) {
+		nc_lruhead->nc_lruprev = nc;
+	}
+	else {
+		nc_lrutail = nc;
+	}
+	nc_lruhead = nc;
+}
+
+static
+void
+nc_lru_addtail(struct ncentry *nc)
+{
+	nc->nc_lrunext = NULL;
+	nc->nc_lruprev = nc_lrutail;
+	if (nc_lrutail != NULL) {
+		nc_lrutail->nc_lrunext = nc;
+	}
+	else {
+		nc_lruhead = nc;
+	}
+	nc_lrutail = nc;
+}
+
+static
+struct ncentry *
+nc_find(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+
+	for (nc = nc_hash[nc_hashfunc(dir, name)]; nc != NULL;
+	     nc = nc->nc_hashnext) {
+		if (nc->nc_dir == dir && !strcmp(nc->nc_name, name)) {
+			return nc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry off its hash chain and move it to the free end of
+ * the LRU list.
+ */
+static
+void
+nc_free(struct ncentry *nc)
+{
+	struct ncentry **pp;
+
+	KASSERT(nc->nc_dir != NULL);
+
+	pp = &nc_hash[nc_hashfunc(nc->nc_dir, nc->nc_name)];
+	while (*pp != nc) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->nc_hashnext;
+	}
+	*pp = nc->nc_hashnext;
+	nc->nc_hashnext = NULL;
+	nc->nc_dir = NULL;
+	nc->nc_vn = NULL;
+
+	nc_lru_unlink(nc);
+	nc_lru_addtail(nc);
+}
+
+bool
+vfs_ncache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct ncentry *nc;
+
+	if (strlen(name) > NC_NAMELEN) {
+		return false;
+	}
+
+	spinlock_acquire(&nc_lock);
+	nc = nc_find(dir, name);
+	if (nc == NULL) {
+		nc_misses++;
+		spinlock_release(&nc_lock);
+		return false;
+	}
+
+	nc_lru_unlink(nc);
+	nc_lru_addhead(nc);
+
+	if (nc->nc_vn != NULL) {
+		VOP_INCREF(nc->nc_vn);
+		nc_hits++;
+	}
+	else {
+		nc_neghits++;
+	}
+	*ret = nc->nc_vn;
+	spinlock_release(&nc_lock);
+	return true;
+}
+
+void
+vfs_ncache_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct ncentry *nc;
+	unsigned h;
+
+	if (strlen(name) > NC_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&nc_lock);
+	nc = nc_find(dir, name);
+	if (nc == NULL) {
+		/* Take the least recently used entry */
+		nc = nc_lrutail;
+		if (nc->nc_dir != NULL) {
+			nc_free(nc);
+			nc_evictions++;
+		}
+		nc->nc_dir = dir;
+		strcpy(nc->nc_name, name);
+		h = nc_hashfunc(dir, name);
+		nc->nc_hashnext = nc_hash[h];
+		nc_hash[h] = nc;
+	}
+	nc->nc_vn = vn;
+
+	nc_lru_unlink(nc);
+	nc_lru_addhead(nc);
+	nc_enters++;
+	spinlock_release(&nc_lock);
+}
+
+void
+vfs_ncache_remove(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+
+	if (strlen(name) > NC_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&nc_lock);
+	nc = nc_find(dir, name);
+	if (nc != NULL) {
+		nc_free(nc);
+	}
+	spinlock_release(&nc_lock);
+}
+
+void
+vfs_ncache_purgevn(struct vnode *vn)
+{
+	unsigned i;
+
+	spinlock_acquire(&nc_lock);
+	for (i=0; i<NC_NENTRIES; i++) {
+		if (nc_entries[i].nc_dir == NULL) {
+			continue;
+		}
+		if (nc_entries[i].nc_dir == vn || nc_entries[i].nc_vn == vn) {
+			nc_free(&nc_entries[i]);
+		}
+	}
+	spinlock_release(&nc_lock);
+}
+
+void
+vfs_ncache_printstats(void)
+{
+	unsigned i, used = 0, negative = 0;
+	unsigned hits, neghits, misses, enters, evictions;
+
+	/* Don't kprintf under a spinlock */
+	spinlock_acquire(&nc_lock);
+	for (i=0; i<NC_NENTRIES; i++) {
+		if (nc_entries[i].nc_dir != NULL) {
+			used++;
+			if (nc_entries[i].nc_vn == NULL) {
+				negative++;
+			}
+		}
+	}
+	hits = nc_hits;
+	neghits = nc_neghits;
+	misses = nc_misses;
+	enters = nc_enters;
+	evictions = nc_evictions;
+	spinlock_release(&nc_lock);
+
+	kprintf("Name cache: %u/%u entries (%u negative)\n",
+		used, NC_NENTRIES, negative);
+	kprintf("    %u hits, %u negative hits, %u misses\n",
+		hits, neghits, misses);
+	kprintf("    %u entered, %u evicted\n", enters, evictions);
+}
@@ -43,6 +43,10 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <swap.h>
+#endif /* OPT_A3 */
 
 /*
  * Structure for a single named device.
@@ -109,6 +113,8 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	vfs_ncache_init();
+
 	devnull_create();
 }
 
@@ -499,6 +505,27 @@ findmount(const char *devname, struct knowndev **result)
 	return found ? 0 : ENODEV;
 }
 
+/*
+ * Check if a filesystem is mounted on DEV.
+ */
+bool
+vfs_devismounted(struct device *dev)
+{
+	struct knowndev *kd;
+	unsigned i, num;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		kd = knowndevarray_get(knowndevs, i);
+		if (kd->kd_device == dev && kd->kd_fs != NULL) {
+			return true;
+		}
+	}
+	return false;
+}
+
 /*
  * Mount a filesystem. Once we've found the device, call MOUNTFUNC to
  * set up the filesystem and hand back a struct fs.
@@ -526,6 +553,13 @@ vfs_mount(const char *devname, void *data,
 		vfs_biglock_release();
 		return EBUSY;
 	}
+#if OPT_A3
+	if (swap_usesdevice(kd->kd_device)) {
+		/* the filesystem would be overwritten by paging */
+		vfs_biglock_release();
+		return EBUSY;
+	}
+#endif /* OPT_A3 */
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
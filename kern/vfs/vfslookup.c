@@ -243,6 +243,12 @@ vfs_lookparent(char *path, struct vnode **retval,
 		return result;
 	}
 
+	/*
+	 * We have our own reference to startvn; the filesystem does
+	 * its own locking from here on.
+	 */
+	vfs_biglock_release();
+
 	if (strlen(path)==0) {
 		/*
 		 * It does not make sense to use just a device name in
@@ -256,8 +262,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 	}
 
 	VOP_DECREF(startvn);
-
-	vfs_biglock_release();
 	return result;
 }
 
@@ -275,15 +279,15 @@ vfs_lookup(char *path, struct vnode **retval)
 		return result;
 	}
 
+	vfs_biglock_release();
+
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	result = VOP_LOOKUP(startvn, path, retval);
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Swap space management.
+ *
+ * The swap area is a whole raw disk, opened through vfs_open like any
+ * other device. It is carved into page-sized slots, and a bitmap
+ * records which slots hold a page. The VM system decides what to put
+ * in them; this file only hands out slots and moves pages.
+ *
+ * Page I/O goes straight to the device rather than through VOP_READ
+ * and VOP_WRITE. Those take file system locks, and a thread holding
+ * one in the middle of a file system call can fault on a page that is
+ * on its way out to swap; if the page-out needed the same lock, neither
+ * would ever finish.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <stat.h>
+#include <device.h>
+#include <vm.h>
+#include <swap.h>
+
+static struct vnode *swap_vnode;	/* NULL if there is no swap */
+static struct bitmap *swap_map;		/* one bit per slot; set = in use */
+static unsigned swap_slots;
+static unsigned swap_inuse;
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Open the raw disk DEVNAME and make a slot map for it. The caller
+ * holds vfs_biglock, so nothing can be mounted on it meanwhile.
+ */
+static
+int
+swap_open(const char *devname, struct vnode **vnret, struct bitmap **mapret,
+	  unsigned *slotsret)
+{
+	char path[32];
+	struct vnode *vn;
+	struct bitmap *map;
+	struct stat st;
+	unsigned slots;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	/* vfs_open may scribble on the name */
+	if (strlen(devname) >= sizeof(path)) {
+		return ENAMETOOLONG;
+	}
+	strcpy(path, devname);
+
+	result = vfs_open(path, O_RDWR, 0, &vn);
+	if (result) {
+		return result;
+	}
+
+	result = VOP_STAT(vn, &st);
+	if (result == 0 && (st.st_mode & S_IFMT) != S_IFBLK) {
+		/* only a raw disk will do; see swap_io */
+		result = ENODEV;
+	}
+	if (result == 0 && vfs_devismounted(vn->vn_data)) {
+		/* swapping on it would overwrite the filesystem */
+		result = EBUSY;
+	}
+	if (result == 0 && st.st_size < PAGE_SIZE) {
+		result = ENOSPC;
+	}
+	if (result) {
+		vfs_close(vn);
+		return result;
+	}
+
+	slots = st.st_size / PAGE_SIZE;
+	map = bitmap_create(slots);
+	if (map == NULL) {
+		vfs_close(vn);
+		return ENOMEM;
+	}
+
+	*vnret = vn;
+	*mapret = map;
+	*slotsret = slots;
+	return 0;
+}
+
+void
+swap_bootstrap(void)
+{
+	int result;
+
+	result = swap_setdevice(SWAP_DEVICE);
+	if (result) {
+		kprintf("swap: %s: %s; swapping disabled\n",
+			SWAP_DEVICE, strerror(result));
+	}
+}
+
+int
+swap_setdevice(const char *devname)
+{
+	struct vnode *vn = NULL, *oldvn;
+	struct bitmap *map = NULL, *oldmap;
+	unsigned slots = 0;
+	int result;
+
+	vfs_biglock_acquire();
+
+	/* Turn swapping off, unless it's in use */
+	spinlock_acquire(&swap_lock);
+	if (swap_inuse > 0) {
+		spinlock_release(&swap_lock);
+		vfs_biglock_release();
+		return EBUSY;
+	}
+	oldvn = swap_vnode;
+	oldmap = swap_map;
+	swap_vnode = NULL;
+	swap_map = NULL;
+	swap_slots = 0;
+	spinlock_release(&swap_lock);
+
+	if (oldvn != NULL) {
+		vfs_close(oldvn);
+		bitmap_destroy(oldmap);
+	}
+
+	if (devname != NULL) {
+		result = swap_open(devname, &vn, &map, &slots);
+		if (result) {
+			vfs_biglock_release();
+			return result;
+		}
+		spinlock_acquire(&swap_lock);
+		swap_vnode = vn;
+		swap_map = map;
+		swap_slots = slots;
+		spinlock_release(&swap_lock);
+		kprintf("swap: %s, %u pages\n", devname, slots);
+	}
+
+	vfs_biglock_release();
+	return 0;
+}
+
+bool
+swap_usesdevice(struct device *dev)
+{
+	/* swap_vnode only changes under vfs_biglock */
+	KASSERT(vfs_biglock_do_i_hold());
+	return swap_vnode != NULL && swap_vnode->vn_data == dev;
+}
+
+bool
+swap_enabled(void)
+{
+	return swap_vnode != NULL;
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	spinlock_acquire(&swap_lock);
+	if (swap_vnode == NULL) {
+		spinlock_release(&swap_lock);
+		return ENOSPC;
+	}
+	result = bitmap_alloc(swap_map, slot);
+	if (result == 0) {
+		swap_inuse++;
+	}
+	spinlock_release(&swap_lock);
+	return result;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_slots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	swap_inuse--;
+	spinlock_release(&swap_lock);
+}
+
+/* move one page between PADDR and SLOT in direction RW */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct device *d;
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_slots);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	d = swap_vnode->vn_data;
+	result = d->d_io(d, &ku);
+	if (result == 0 && ku.uio_resid != 0) {
+		result = EIO;
+	}
+	return result;
+}
+
+int
+swap_read(unsigned slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_READ);
+}
+
+int
+swap_write(unsigned slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_WRITE);
+}
+
+void
+swap_usage(unsigned *used, unsigned *total)
+{
+	spinlock_acquire(&swap_lock);
+	*used = swap_inuse;
+	*total = swap_slots;
+	spinlock_release(&swap_lock);
+}
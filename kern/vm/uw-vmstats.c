@@ -33,6 +33,17 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "Copy-on-write Breaks",
+ /* 11 */ "Evictions (FIFO)",
+ /* 12 */ "Evictions (Random)",
+ /* 13 */ "Evictions (Clock)",
+ /* 14 */ "Clean Pages Discarded",
+ /* 15 */ "Clock Second Chances",
+ /* 16 */ "Software TLB Hits",
+ /* 17 */ "TLB Invalidations (ASID Wrap)",
+ /* 18 */ "TLB Invalidations (ASID Retired)",
+ /* 19 */ "TLB Invalidations (Page-out)",
+ /* 20 */ "TLB Invalidations (Clock)",
 };
 
 
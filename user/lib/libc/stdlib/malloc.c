@@ -30,10 +30,20 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * Every block carries a header giving the offsets of its neighbours,
+ * but the heap is never searched block by block:
+ *
+ *    - Requests of up to MSMALLMAX bytes are rounded up to a multiple
+ *      of MBLOCKSIZE and served from a free list per size. A freed
+ *      small block goes back on its list and still counts as in use,
+ *      so it is never merged; malloc and free are O(1) for these.
+ *
+ *    - Anything bigger is served first-fit from a list holding only
+ *      the free blocks. A freed large block is merged with any free
+ *      neighbours at once, so no two free blocks are ever adjacent.
+ *
+ * More memory comes from sbrk at the top of the heap; a free block at
+ * the top gets extended rather than left behind.
  */
 
 #include <stdlib.h>
@@ -59,8 +69,9 @@
  *
  * mh_nextblock is the upwards offset to the next header.
  *
- * mh_pad is unused.
- * mh_inuse is 1 if the block is in use, 0 if it is free.
+ * mh_small is 1 if the block is free but sitting on a size list.
+ * mh_inuse is 1 if the block is in use (or on a size list), 0 if it
+ * is on the large free list.
  * mh_magic* should always be a fixed value.
  *
  * MBLOCKSIZE should equal sizeof(struct mheader) and be a power of 2.
@@ -78,7 +89,7 @@ struct mheader {
 	 * Block size is 8 bytes.
 	 */
 	unsigned mh_prevblock:29;
-	unsigned mh_pad:1;
+	unsigned mh_small:1;
 	unsigned mh_magic1:2;
 
 	unsigned mh_nextblock:29;
@@ -94,7 +105,7 @@ struct mheader {
 	 * Block size is 16 bytes.
 	 */
 	unsigned mh_prevblock:62;
-	unsigned mh_pad:1;
+	unsigned mh_small:1;
 	unsigned mh_magic1:3;
 
 	unsigned mh_nextblock:62;
@@ -106,6 +117,16 @@ struct mheader {
 #endif
 };
 
+/*
+ * Free list links, kept in the data area of a free block. The size
+ * lists only use mf_next. Every block has room for them, because no
+ * block is smaller than MBLOCKSIZE.
+ */
+struct mfree {
+	struct mfree *mf_next;
+	struct mfree *mf_prev;
+};
+
 /*
  * Operator macros on struct mheader.
  *
@@ -114,6 +135,7 @@ struct mheader {
  * 
  * M_DATA:		return data pointer of a header
  * M_SIZE:		return data size of a header
+ * M_HEADER:		return header of a data pointer
  *
  * M_OK:		true if the magic values are correct
  * 
@@ -128,17 +150,29 @@ struct mheader {
 
 #define M_DATA(mh)	((void *)((mh)+1))
 #define M_SIZE(mh)	(M_NEXTOFF(mh)-MBLOCKSIZE)
+#define M_HEADER(x)	(((struct mheader *)(x))-1)
 
 #define M_OK(mh)	((mh)->mh_magic1==MMAGIC && (mh)->mh_magic2==MMAGIC)
 
 #define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
 
+/*
+ * Small sizes: everything up to MSMALLMAX bytes has its own free
+ * list, indexed by size in blocks.
+ */
+#define MSMALLMAX	512
+#define MNSMALL		(MSMALLMAX/MBLOCKSIZE + 1)
+
 ////////////////////////////////////////////////////////////
 
 /*
- * Static variables - the bottom and top addresses of the heap.
+ * Static variables - the bottom and top addresses of the heap, the
+ * highest block in it, and the free lists.
  */
 static uintptr_t __heapbase, __heaptop;
+static struct mheader *__heaplast;
+static struct mfree *__smallfree[MNSMALL];
+static struct mfree *__largefree;
 
 /*
  * Setup function.
@@ -241,19 +275,82 @@ __malloc_dump(void)
 		      (unsigned long) i + MBLOCKSIZE,
 		      (unsigned long) M_SIZE(mh),
 		      (unsigned long) (i+M_NEXTOFF(mh)),
+		      mh->mh_small ? "SMALLFREE" :
 		      mh->mh_inuse ? "INUSE" : "FREE");
 	}
 	if (i!=__heaptop) {
 		errx(1, "malloc: Heap corrupt; ran off end");
 	}
+	if (__heaplast != NULL && M_NEXT(__heaplast) != (struct mheader *)i) {
+		errx(1, "malloc: Heap corrupt; last block 0x%lx is wrong",
+		     (unsigned long)(uintptr_t) __heaplast);
+	}
 
 	warnx("heap: ************************************************");
 }
 
+/*
+ * Clear a range of memory with 0xdeadbeef.
+ * ptr must be suitably aligned.
+ *
+ * This used to be done on every free; it is now only a debugging aid,
+ * since touching every freed byte costs as much as the rest of free
+ * put together.
+ */
+static
+void
+__malloc_deadbeef(void *ptr, size_t size)
+{
+	uint32_t *x = ptr;
+	size_t i, n = size/sizeof(uint32_t);
+	for (i=0; i<n; i++) {
+		x[i] = 0xdeadbeef;
+	}
+}
+
 #endif /* MALLOCDEBUG */
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Put a block on / take a block off the large free list.
+ */
+static
+void
+__malloc_link(struct mheader *mh)
+{
+	struct mfree *mf = M_DATA(mh);
+
+	mh->mh_inuse = 0;
+	mf->mf_prev = NULL;
+	mf->mf_next = __largefree;
+	if (__largefree != NULL) {
+		__largefree->mf_prev = mf;
+	}
+	__largefree = mf;
+}
+
+static
+void
+__malloc_unlink(struct mheader *mh)
+{
+	struct mfree *mf = M_DATA(mh);
+
+	if (mh->mh_inuse) {
+		errx(1, "malloc: Internal error (unlinking block in use)");
+	}
+	if (mf->mf_prev != NULL) {
+		mf->mf_prev->mf_next = mf->mf_next;
+	}
+	else {
+		__largefree = mf->mf_next;
+	}
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf->mf_prev;
+	}
+	mh->mh_inuse = 1;
+}
+
 /*
  * Get more memory (at the top of the heap) using sbrk, and 
  * return a pointer to it.
@@ -282,7 +379,8 @@ __malloc_sbrk(size_t size)
 /*
  * Make a new (free) block from the block passed in, leaving size
  * bytes for data in the current block. size must be a multiple of
- * MBLOCKSIZE.
+ * MBLOCKSIZE. The block passed in must not be on the free list; the
+ * new block goes on it.
  *
  * Only split if the excess space is at least twice the blocksize -
  * one blocksize to hold a header and one for data.
@@ -315,141 +413,88 @@ __malloc_split(struct mheader *mh, size_t size)
 	}
 
 	mhnew->mh_prevblock = M_MKFIELD(size + MBLOCKSIZE);
-	mhnew->mh_pad = 0;
+	mhnew->mh_small = 0;
 	mhnew->mh_magic1 = MMAGIC;
 	mhnew->mh_nextblock = M_MKFIELD(oldsize - size);
-	mhnew->mh_inuse = 0;
 	mhnew->mh_magic2 = MMAGIC;
+	__malloc_link(mhnew);
 
 	if (mhnext != (struct mheader *) __heaptop) {
 		mhnext->mh_prevblock = mhnew->mh_nextblock;
 	}
+	else {
+		__heaplast = mhnew;
+	}
 }
 
 /*
- * malloc itself.
+ * Make room for a block of size bytes at the top of the heap. If the
+ * top block is free it is grown in place; otherwise a new block is
+ * started. Either way the block returned is marked in use.
  */
-void *
-malloc(size_t size)
+static
+struct mheader *
+__malloc_grow(size_t size)
 {
-	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
-
-	if (__heapbase==0) {
-		__malloc_init();
-	}
-	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
-		warnx("malloc: Internal error - local data corrupt");
-		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx", 
-		     (unsigned long) __heapbase, (unsigned long) __heaptop);
-	}
-
-#ifdef MALLOCDEBUG
-	warnx("malloc: about to allocate %lu (0x%lx) bytes", 
-	      (unsigned long) size, (unsigned long) size);
-	__malloc_dump();
-#endif
-
-	/* Round size up to an integral number of blocks. */
-	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	struct mheader *mh = __heaplast;
 
-	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
-	 */
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
+	if (mh != NULL && !mh->mh_inuse) {
+		if (__malloc_sbrk(size - M_SIZE(mh)) == NULL) {
+			return NULL;
 		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
-
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
-		}
-
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
-		/*
-		 * Now, allocate.
-		 */
-		mh->mh_inuse = 1;
-
-#ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
-#endif
-		return M_DATA(mh);
-	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
+		__malloc_unlink(mh);
+		mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
+		return mh;
 	}
 
-	/*
-	 * Didn't find anything. Expand the heap.
-	 */
-
 	mh = __malloc_sbrk(size + MBLOCKSIZE);
 	if (mh == NULL) {
 		return NULL;
 	}
 
-	mh->mh_prevblock = rightprevblock;
+	mh->mh_prevblock = __heaplast != NULL ? __heaplast->mh_nextblock : 0;
 	mh->mh_magic1 = MMAGIC;
 	mh->mh_magic2 = MMAGIC;
-	mh->mh_pad = 0;
+	mh->mh_small = 0;
 	mh->mh_inuse = 1;
 	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
-
-#ifdef MALLOCDEBUG
-	warnx("malloc: allocating at %p", M_DATA(mh));
-	__malloc_dump();
-#endif
-	return M_DATA(mh);
+	__heaplast = mh;
+	return mh;
 }
 
-////////////////////////////////////////////////////////////
-
 /*
- * Clear a range of memory with 0xdeadbeef.
- * ptr must be suitably aligned.
+ * First-fit search of the large free list. The block found is taken
+ * off the list, split down to size, and returned.
  */
 static
-void
-__malloc_deadbeef(void *ptr, size_t size)
+struct mheader *
+__malloc_fit(size_t size)
 {
-	uint32_t *x = ptr;
-	size_t i, n = size/sizeof(uint32_t);
-	for (i=0; i<n; i++) {
-		x[i] = 0xdeadbeef;
+	struct mheader *mh;
+	struct mfree *mf;
+
+	for (mf = __largefree; mf != NULL; mf = mf->mf_next) {
+		mh = M_HEADER(mf);
+		if (!M_OK(mh) || mh->mh_inuse) {
+			errx(1, "malloc: Heap corrupt; block %p on free list "
+			     "is bad", mf);
+		}
+		if (M_SIZE(mh) >= size) {
+			__malloc_unlink(mh);
+			__malloc_split(mh, size);
+			return mh;
+		}
 	}
+	return NULL;
 }
 
 /*
- * Attempt to merge two adjacent blocks (mh below mhnext).
+ * Merge two adjacent free blocks (mh below mhnext), neither of which
+ * is on the free list.
  */
 static
 void
-__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
+__malloc_merge(struct mheader *mh, struct mheader *mhnext)
 {
 	struct mheader *mhnextnext;
 
@@ -457,10 +502,6 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
 		     mh, mhnext);
 	}
-	if (mh->mh_inuse || mhnext->mh_inuse) {
-		/* can't merge */
-		return;
-	}
 
 	mhnextnext = M_NEXT(mhnext);
 
@@ -470,18 +511,163 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	if (mhnextnext != (struct mheader *)__heaptop) {
 		mhnextnext->mh_prevblock = mh->mh_nextblock;
 	}
+	else {
+		__heaplast = mh;
+	}
 
+#ifdef MALLOCDEBUG
 	/* Deadbeef out the memory used by the now-obsolete header */
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
+#endif
 }
 
+/*
+ * Put a block that is no longer in use on the large free list,
+ * merging it with its free neighbours first.
+ */
+static
+void
+__malloc_release(struct mheader *mh)
+{
+	struct mheader *mhnext, *mhprev;
+
+	/* Merge with the block above (but not if we're at the top) */
+	mhnext = M_NEXT(mh);
+	if (mhnext != (struct mheader *)__heaptop && !mhnext->mh_inuse) {
+		__malloc_unlink(mhnext);
+		__malloc_merge(mh, mhnext);
+	}
+
+	/* Merge with the block below (but not if we're at the bottom) */
+	if (mh != (struct mheader *)__heapbase) {
+		mhprev = M_PREV(mh);
+		if (!mhprev->mh_inuse) {
+			__malloc_unlink(mhprev);
+			__malloc_merge(mhprev, mh);
+			mh = mhprev;
+		}
+	}
+
+	__malloc_link(mh);
+}
+
+/*
+ * Empty the size lists onto the large free list, so their blocks can
+ * be merged and used for other sizes. Only done when the heap can't
+ * grow. Returns nonzero if anything was released.
+ */
+static
+int
+__malloc_reclaim(void)
+{
+	struct mheader *mh;
+	struct mfree *mf;
+	size_t n;
+	int found = 0;
+
+	for (n=0; n<MNSMALL; n++) {
+		while (__smallfree[n] != NULL) {
+			mf = __smallfree[n];
+			__smallfree[n] = mf->mf_next;
+			mh = M_HEADER(mf);
+			mh->mh_small = 0;
+			__malloc_release(mh);
+			found = 1;
+		}
+	}
+	return found;
+}
+
+/*
+ * malloc itself.
+ */
+void *
+malloc(size_t size)
+{
+	struct mheader *mh;
+	struct mfree *mf;
+	size_t n;
+
+	if (__heapbase==0) {
+		__malloc_init();
+	}
+	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
+		warnx("malloc: Internal error - local data corrupt");
+		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx", 
+		     (unsigned long) __heapbase, (unsigned long) __heaptop);
+	}
+
+#ifdef MALLOCDEBUG
+	warnx("malloc: about to allocate %lu (0x%lx) bytes", 
+	      (unsigned long) size, (unsigned long) size);
+	__malloc_dump();
+#endif
+
+	/* Don't let the rounding below wrap around. */
+	if (size > ((size_t)-1 >> 1)) {
+		return NULL;
+	}
+
+	/*
+	 * Round size up to an integral number of blocks, and at least
+	 * one so a free block can hold its list links.
+	 */
+	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	if (size == 0) {
+		size = MBLOCKSIZE;
+	}
+
+	/* Small sizes: take the first block off the list, if any. */
+	n = size >> MBLOCKSHIFT;
+	if (n < MNSMALL && __smallfree[n] != NULL) {
+		mf = __smallfree[n];
+		__smallfree[n] = mf->mf_next;
+		mh = M_HEADER(mf);
+		if (!M_OK(mh) || !mh->mh_small) {
+			errx(1, "malloc: Heap corrupt; block %p on size list "
+			     "is bad", mf);
+		}
+		mh->mh_small = 0;
+		return mf;
+	}
+
+	/*
+	 * First fit among the free blocks; if nothing fits, expand the
+	 * heap. If that fails too, give the memory sitting on the size
+	 * lists back and try once more.
+	 */
+	mh = __malloc_fit(size);
+	if (mh == NULL) {
+		mh = __malloc_grow(size);
+	}
+	if (mh == NULL && __malloc_reclaim()) {
+		mh = __malloc_fit(size);
+		if (mh == NULL) {
+			mh = __malloc_grow(size);
+		}
+	}
+	if (mh == NULL) {
+		return NULL;
+	}
+
+#ifdef MALLOCDEBUG
+	warnx("malloc: allocating at %p", M_DATA(mh));
+	__malloc_dump();
+#endif
+	return M_DATA(mh);
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * The actual free() implementation.
  */
 void
 free(void *x)
 {
-	struct mheader *mh, *mhnext, *mhprev;
+	struct mheader *mh;
+	struct mfree *mf;
+	size_t n;
 
 	if (x==NULL) {
 		/* safest practice */
@@ -505,32 +691,31 @@ free(void *x)
 	__malloc_dump();
 #endif
 
-	mh = ((struct mheader *)x)-1;
+	mh = M_HEADER(x);
 	if (!M_OK(mh)) {
 		errx(1, "free: Invalid pointer %p freed (corrupt header)", x);
 	}
 
-	if (!mh->mh_inuse) {
+	if (!mh->mh_inuse || mh->mh_small) {
 		errx(1, "free: Invalid pointer %p freed (already free)", x);
 	}
 
-	/* mark it free */
-	mh->mh_inuse = 0;
-
+#ifdef MALLOCDEBUG
 	/* wipe it */
 	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+#endif
 
-	/* Try merging with the block above (but not if we're at the top) */
-	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	/* Small blocks just go back on their size list. */
+	n = M_SIZE(mh) >> MBLOCKSHIFT;
+	if (n < MNSMALL) {
+		mf = x;
+		mh->mh_small = 1;
+		mf->mf_next = __smallfree[n];
+		__smallfree[n] = mf;
+		return;
 	}
 
-	/* Try merging with the block below (but not if we're at the bottom) */
-	if (mh != (struct mheader *)__heapbase) {
-		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
-	}
+	__malloc_release(mh);
 
 #ifdef MALLOCDEBUG
 	warnx("free: freed %p", x);
@@ -49,6 +49,7 @@
 
 #define SMALLSIZE   72
 #define MEDIUMSIZE  896
+#define LARGESIZE   640	/* smallest size malloc merges is 513 */
 #define BIGSIZE     16384
 #define HUGESIZE    (1024 * 1024 * 1024)
 
@@ -380,8 +381,10 @@ test3(void)
  *
  * Tries to test in detail if malloc coalesces the free list properly.
  *
- * This test will likely fail if something other than a basic first-fit/
- * next-fit/best-fit algorithm is used.
+ * The libc malloc only merges blocks bigger than 512 bytes, so this uses
+ * two of those, and then checks that a small block is reused as is.
+ * It will likely fail if something other than a basic first-fit/
+ * next-fit/best-fit algorithm is used for large blocks.
  */
 
 static
@@ -397,9 +400,9 @@ test4(void)
 
 	printf("Testing free list coalescing:\n");
 
-	x = malloc(SMALLSIZE);
+	x = malloc(LARGESIZE);
 	if (x==NULL) {
-		printf("FAILED: malloc(%u) failed\n", SMALLSIZE);
+		printf("FAILED: malloc(%u) failed\n", LARGESIZE);
 		return;
 	}
 
@@ -440,7 +443,7 @@ test4(void)
 	 * block is within the other block, either the start is too,
 	 * or the other block's start is within the first block.)
 	 */
-	if (lx < ly && lx + SMALLSIZE > ly) {
+	if (lx < ly && lx + LARGESIZE > ly) {
 		printf("FAIL: y starts within x\n");
 		return;
 	}
@@ -462,7 +465,7 @@ test4(void)
 	/*
 	 * Compute the space used by index structures.
 	 */
-	overhead = ly - (lx + SMALLSIZE);
+	overhead = ly - (lx + LARGESIZE);
 	printf("Apparent block overhead: %lu\n", overhead);
 
 	if (overhead > ABSURD_OVERHEAD) {
@@ -478,7 +481,7 @@ test4(void)
 	free(x);
 	free(y);
 
-	zsize = SMALLSIZE + MEDIUMSIZE + overhead;
+	zsize = LARGESIZE + MEDIUMSIZE + overhead;
 
 	printf("Now allocating %lu bytes... should reuse the space.\n", zsize);
 	z = malloc(zsize);
@@ -491,14 +494,38 @@ test4(void)
 
 	printf("z is 0x%lx (x was 0x%lx, y 0x%lx)\n", lz, lx, ly);
 
-	if (lz==lx) {
+	if (lz!=lx) {
+		printf("Failed.\n");
+		free(z);
+		return;
+	}
+	free(z);
+
+	/*
+	 * Small blocks are never merged; instead a freed one should
+	 * be handed straight back for the next request of its size.
+	 */
+	printf("Testing small block reuse:\n");
+	x = malloc(SMALLSIZE);
+	if (x==NULL) {
+		printf("FAILED: malloc(%u) failed\n", SMALLSIZE);
+		return;
+	}
+	free(x);
+	y = malloc(SMALLSIZE);
+	if (y==NULL) {
+		printf("FAILED: malloc(%u) failed\n", SMALLSIZE);
+		return;
+	}
+	printf("y is %p (x was %p)\n", y, x);
+	free(y);
+
+	if (y==x) {
 		printf("Passed.\n");
 	}
 	else {
 		printf("Failed.\n");
 	}
-
-	free(z);
 }
 
 ////////////////////////////////////////////////////////////
@@ -623,6 +650,74 @@ test7(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Test 8
+ *
+ * Times malloc and free. Keeps TIMESLOTS blocks live and replaces a
+ * random one at a time, mostly with small sizes and now and then a
+ * big one, the way typical programs do. The blocks are not touched, so
+ * (apart from page faults on new heap) this is the allocator alone.
+ */
+
+#define TIMESLOTS  512
+#define TIMEOPS    200000
+
+static
+void
+test8(void)
+{
+	static void *ptrs[TIMESLOTS];
+	time_t secs0, secs1;
+	unsigned long nsecs0, nsecs1, usecs;
+	size_t size;
+	int i, n;
+
+	printf("Beginning malloc test 8\n");
+	srandom(0);
+
+	__time(&secs0, &nsecs0);
+	for (i=0; i<TIMEOPS; i++) {
+		n = random() % TIMESLOTS;
+		free(ptrs[n]);
+		if (random() % 16 == 0) {
+			size = MEDIUMSIZE + random() % BIGSIZE;
+		}
+		else {
+			size = 1 + random() % (2*SMALLSIZE);
+		}
+		ptrs[n] = malloc(size);
+		if (ptrs[n] == NULL) {
+			printf("FAILED: malloc %lu failed\n",
+			       (unsigned long) size);
+			break;
+		}
+	}
+	__time(&secs1, &nsecs1);
+
+	for (n=0; n<TIMESLOTS; n++) {
+		free(ptrs[n]);
+		ptrs[n] = NULL;
+	}
+	if (i < TIMEOPS) {
+		return;
+	}
+
+	if (nsecs1 < nsecs0) {
+		nsecs1 += 1000000000;
+		secs1--;
+	}
+	usecs = (secs1 - secs0) * 1000000 + (nsecs1 - nsecs0) / 1000;
+	printf("%d malloc/free pairs in %lu.%06lu seconds",
+	       TIMEOPS, usecs / 1000000, usecs % 1000000);
+	if (usecs > 0) {
+		printf(" (%lu ns each)", usecs / (TIMEOPS / 1000));
+	}
+	printf("\n");
+	printf("Passed malloc test 8\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static struct {
 	int num;
 	const char *desc;
@@ -631,10 +726,11 @@ static struct {
 	{ 1, "Simple allocation test", test1 },
 	{ 2, "Allocate all memory in a big chunk", test2 },
 	{ 3, "Allocate all memory in small chunks", test3 },
-	{ 4, "Free list coalescing test (first/next/best-fit only)", test4 },
+	{ 4, "Free list coalescing and small block reuse test", test4 },
 	{ 5, "Stress test", test5 },
 	{ 6, "Randomized stress test", test6 },
 	{ 7, "Stress test with particular seed", test7 },
+	{ 8, "Timing test", test8 },
 	{ -1, NULL, NULL }
 };
 